@@ -142,6 +142,9 @@ PRODUCT_PACKAGES += \
     lightsctl \
     uevent
 
+PRODUCT_COPY_FILES += \
+	device/phh/treble/files/uevent.rules:system/phh/uevent.rules
+
 PRODUCT_COPY_FILES += \
 	device/phh/treble/files/adbd.rc:system/etc/init/adbd.rc
 
@@ -187,10 +190,19 @@ PRODUCT_COPY_FILES += \
 	device/phh/treble/remote/phh-remotectl.rc:system/etc/init/phh-remotectl.rc \
 	device/phh/treble/remote/phh-remotectl.sh:system/bin/phh-remotectl.sh \
 
+# Oppo/Realme fingerprint adapter, as an AIDL IFingerprint (Android 12+) or a 2.1 HAL
+ifeq ($(PHH_FINGERPRINT_AIDL),true)
+PRODUCT_PACKAGES += \
+	android.hardware.biometrics.fingerprint-service.oppo.compat \
+	android.hardware.biometrics.fingerprint-service.oplus.compat \
+
+else
 PRODUCT_PACKAGES += \
 	android.hardware.biometrics.fingerprint@2.1-service.oppo.compat \
 	android.hardware.biometrics.fingerprint@2.1-service.oplus.compat \
 
+endif
+
 PRODUCT_PACKAGES += \
 	vr_hwc \
 	curl \
@@ -2,5 +2,9 @@ TARGET_SYSTEM_PROP := device/phh/treble/system.prop $(TARGET_SYSTEM_PROP)
 BOARD_BLUETOOTH_BDROID_BUILDCFG_INCLUDE_DIR := device/phh/treble/bluetooth
 TARGET_EXFAT_DRIVER := exfat
 DEVICE_FRAMEWORK_MANIFEST_FILE := device/phh/treble/framework_manifest.xml
+# The AIDL fingerprint adapter declares itself, see base.mk
+ifneq ($(PHH_FINGERPRINT_AIDL),true)
+DEVICE_FRAMEWORK_MANIFEST_FILE += device/phh/treble/framework_manifest_fingerprint.xml
+endif
 
 BOARD_ROOT_EXTRA_FOLDERS += bt_firmware sec_storage efs
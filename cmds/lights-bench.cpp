@@ -0,0 +1,158 @@
+#include "lights.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+/*
+ * lights-pattern-bench runs the pattern engine against a stand-in light
+ * HAL, which answers every type and can take some time per call the way
+ * a binder round trip would. It reports per scenario the wake-ups, HAL
+ * calls, how late frames ran, and the CPU the engine used, and fails if
+ * an idle engine woke up or a scenario went over the CPU budget.
+ */
+
+// Of one core. The stand-in sleeps instead of spinning, so that is the engine alone
+#define LIGHTS_PATTERN_CPU_BUDGET 1.0
+
+static uint64_t hal_cost_ns;
+static uint64_t hal_calls;
+
+static bool standin_connect() {
+    return true;
+}
+
+static void standin_get_types(std::vector<std::string> *types) {
+    *types = { "BACKLIGHT", "NOTIFICATIONS", "BATTERY", "ATTENTION" };
+}
+
+static bool standin_set(const struct light_cmd *cmd, std::string *status) {
+    (void)cmd;
+    hal_calls++;
+    if(hal_cost_ns) {
+        struct timespec ts = { (time_t)(hal_cost_ns / 1000000000ULL), (long)(hal_cost_ns % 1000000000ULL) };
+        nanosleep(&ts, NULL);
+    }
+    *status = "SUCCESS";
+    return true;
+}
+
+static const struct light_backend standin_backend = {
+    .name = "bench",
+    .extended_brightness = false,
+    .connect = standin_connect,
+    .get_types = standin_get_types,
+    .set = standin_set,
+    .pattern_fps = LIGHTS_PATTERN_FPS,
+};
+
+static uint64_t cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct scenario {
+    const char *name;
+    std::vector<const char*> patterns;
+    bool idle; // must not wake up at all
+};
+
+static bool run_scenario(const struct scenario& sc, int fps, uint64_t duration_ns) {
+    struct light_animator animator;
+    if(!light_animator_init(&animator, &standin_backend, fps)) {
+        perror("timerfd");
+        return false;
+    }
+    hal_calls = 0;
+
+    uint64_t start = lights_now_ns();
+    uint64_t cpu_start = cpu_ns();
+    for(const char *line: sc.patterns) {
+        std::vector<std::string> args;
+        std::string error;
+        struct light_pattern pattern;
+        char *copy = strdup(line);
+        for(char *tok = strtok(copy, " "); tok; tok = strtok(NULL, " "))
+            args.push_back(tok);
+        free(copy);
+        if(!light_pattern_parse(args, &pattern, &error)) {
+            fprintf(stderr, "%s: %s\n", line, error.c_str());
+            return false;
+        }
+        light_animator_start(&animator, pattern, start);
+    }
+
+    std::vector<uint64_t> late;
+    uint64_t end = start + duration_ns;
+    for(uint64_t now = start; now < end; now = lights_now_ns()) {
+        struct pollfd pfd = { animator.timer_fd, POLLIN, 0 };
+        int r = poll(&pfd, 1, (int)((end - now) / 1000000ULL) + 1);
+        if(r < 0 && errno != EINTR) return false;
+        if(r <= 0) continue;
+        uint64_t deadline = animator.deadline_ns;
+        uint64_t woke = lights_now_ns();
+        light_animator_run(&animator, woke);
+        if(deadline) late.push_back(woke - deadline);
+    }
+    uint64_t wall = lights_now_ns() - start;
+    uint64_t cpu = cpu_ns() - cpu_start;
+    close(animator.timer_fd);
+
+    double cpu_pct = 100.0 * cpu / wall;
+    double secs = wall / 1e9;
+    std::sort(late.begin(), late.end());
+    auto pct = [&late](double p) -> double {
+        if(late.empty()) return 0;
+        return late[std::min(late.size() - 1, (size_t)(p * late.size()))] / 1000.0;
+    };
+    uint64_t skipped = animator.frames > animator.writes ? animator.frames - animator.writes : 0;
+
+    bool ok = cpu_pct <= LIGHTS_PATTERN_CPU_BUDGET && (!sc.idle || animator.wakeups == 0);
+    printf("%-22s %8.1f %8.1f %8.1f %7.3f%% %8.0f %8.0f %8.0f  %s\n", sc.name,
+            animator.wakeups / secs, hal_calls / secs, skipped / secs, cpu_pct,
+            pct(0.5), pct(0.99), late.empty() ? 0 : late.back() / 1000.0, ok ? "ok" : "OVER");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int fps = LIGHTS_PATTERN_FPS;
+    int seconds = 5;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            fps = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            hal_cost_ns = strtoull(argv[++i], NULL, 10) * 1000ULL;
+        } else {
+            fprintf(stderr, "Usage: %s [-f fps] [-t seconds per scenario] [-c HAL call cost in us]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<struct scenario> scenarios = {
+        { "idle", {}, true },
+        { "breathe", { "NOTIFICATIONS breathe ff00ff00 4000" }, false },
+        { "blink (holds only)", { "NOTIFICATIONS keys ffffffff:0 ffffffff:500 0:0 0:1500" }, false },
+        { "cycle+breathe x4", {
+            "NOTIFICATIONS cycle 1000 ffff0000 ff00ff00 ff0000ff",
+            "BATTERY breathe ffff8000 3000",
+            "ATTENTION cycle 250 ffffffff ff000000",
+            "BACKLIGHT breathe ff808080 2000",
+        }, false },
+        { "ramp then idle", { "BACKLIGHT ramp ff000000 ffffffff 1000" }, false },
+    };
+
+    printf("%d fps, %d s per scenario, HAL call %llu us, budget %.1f%% of a core, lateness in us\n", fps, seconds,
+            (unsigned long long)(hal_cost_ns / 1000), LIGHTS_PATTERN_CPU_BUDGET);
+    printf("%-22s %8s %8s %8s %8s %8s %8s %8s\n", "scenario", "wake/s", "hal/s", "skip/s", "cpu",
+            "late50", "late99", "latemax");
+    bool ok = true;
+    for(const auto& sc: scenarios)
+        ok &= run_scenario(sc, fps, seconds * 1000000000ULL);
+    return ok ? 0 : 1;
+}
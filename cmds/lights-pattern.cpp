@@ -0,0 +1,236 @@
+#include "lights.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+static bool parse_color(const std::string& s, uint32_t *color) {
+    char *end;
+    *color = (uint32_t)strtoll(s.c_str(), &end, 16);
+    return !s.empty() && *end == 0;
+}
+
+static bool parse_ms(const std::string& s, int *ms) {
+    char *end;
+    long v = strtol(s.c_str(), &end, 10);
+    if(s.empty() || *end != 0 || v < 0 || v > 3600 * 1000) return false;
+    *ms = (int)v;
+    return true;
+}
+
+bool light_pattern_parse(const std::vector<std::string>& args, struct light_pattern *pattern, std::string *error) {
+    if(args.size() < 2) {
+        *error = "expected TYPE breathe|ramp|cycle|keys ...";
+        return false;
+    }
+    pattern->type = args[0];
+    pattern->ext = 0;
+    pattern->keys.clear();
+    pattern->loop = true;
+
+    const std::string& kind = args[1];
+    uint32_t color, to;
+    int ms;
+    if(kind == "breathe") {
+        if(args.size() != 4 || !parse_color(args[2], &color) || !parse_ms(args[3], &ms)) {
+            *error = "expected breathe COLOR PERIOD_MS";
+            return false;
+        }
+        pattern->keys.push_back({ 0, ms / 2, true });
+        pattern->keys.push_back({ color, ms - ms / 2, true });
+    } else if(kind == "ramp") {
+        if(args.size() != 5 || !parse_color(args[2], &color) || !parse_color(args[3], &to) || !parse_ms(args[4], &ms)) {
+            *error = "expected ramp FROM TO MS";
+            return false;
+        }
+        pattern->keys.push_back({ color, 0, false });
+        pattern->keys.push_back({ to, ms, false });
+        pattern->loop = false;
+    } else if(kind == "cycle") {
+        if(args.size() < 5 || !parse_ms(args[2], &ms)) {
+            *error = "expected cycle MS COLOR COLOR...";
+            return false;
+        }
+        for(size_t i = 3; i < args.size(); i++) {
+            if(!parse_color(args[i], &color)) {
+                *error = "bad color " + args[i];
+                return false;
+            }
+            pattern->keys.push_back({ color, ms, false });
+        }
+    } else if(kind == "keys") {
+        if(args.size() < 4) {
+            *error = "expected keys COLOR:MS COLOR:MS...";
+            return false;
+        }
+        for(size_t i = 2; i < args.size(); i++) {
+            size_t colon = args[i].find(':');
+            if(colon == std::string::npos || !parse_color(args[i].substr(0, colon), &color) ||
+                    !parse_ms(args[i].substr(colon + 1), &ms)) {
+                *error = "bad key " + args[i];
+                return false;
+            }
+            pattern->keys.push_back({ color, ms, false });
+        }
+    } else {
+        *error = "unknown pattern " + kind;
+        return false;
+    }
+
+    if(pattern->keys.size() > LIGHTS_PATTERN_MAX_KEYS) {
+        *error = "too many keys";
+        return false;
+    }
+    if(pattern->loop) {
+        bool still = true;
+        for(const auto& key: pattern->keys)
+            if(key.ms != 0) still = false;
+        if(still) {
+            *error = "a looping pattern needs some time";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Per channel, alpha included
+static uint32_t mix(uint32_t a, uint32_t b, double f) {
+    uint32_t out = 0;
+    for(int shift = 0; shift < 32; shift += 8) {
+        int ca = (a >> shift) & 0xff;
+        int cb = (b >> shift) & 0xff;
+        out |= (uint32_t)lround(ca + (cb - ca) * f) << shift;
+    }
+    return out;
+}
+
+/*
+ * Color t ns into the pattern. *until is when, relative to the start, that
+ * color will change if it is held, 0 while fading. Returns true once a
+ * pattern that doesn't loop is over.
+ */
+static bool anim_eval(const struct light_anim *anim, uint64_t t, uint32_t *color, uint64_t *until) {
+    const auto& keys = anim->pattern.keys;
+    size_t n = keys.size();
+    if(!anim->pattern.loop && t >= anim->length_ns) {
+        *color = keys.back().color;
+        *until = 0;
+        return true;
+    }
+    uint64_t base = 0;
+    if(anim->pattern.loop) {
+        base = t - t % anim->length_ns;
+        t -= base;
+    }
+
+    // A loop goes back from the last key to key 0 at the end of its period
+    uint64_t seg_start = 0;
+    size_t segments = anim->pattern.loop ? n : n - 1;
+    for(size_t i = 1; i <= segments; i++) {
+        const struct light_keyframe& from = keys[i - 1];
+        const struct light_keyframe& to = keys[i % n];
+        uint64_t len = to.ms * 1000000ULL;
+        if(t < seg_start + len) {
+            double f = (double)(t - seg_start) / len;
+            if(to.smooth) f = (1 - cos(M_PI * f)) / 2;
+            *color = mix(from.color, to.color, f);
+            *until = from.color == to.color ? base + seg_start + len : 0;
+            return false;
+        }
+        seg_start += len;
+    }
+    *color = keys[0].color;
+    *until = 0;
+    return false;
+}
+
+static bool send_color(struct light_animator *animator, const struct light_pattern& pattern, uint32_t color) {
+    struct light_cmd cmd = { pattern.type, color, pattern.ext, LIGHTS_FLASH_NONE, 0, 0 };
+    std::string status;
+    animator->writes++;
+    return animator->backend->set(&cmd, &status);
+}
+
+static void arm(struct light_animator *animator, uint64_t deadline_ns) {
+    if(deadline_ns == animator->deadline_ns) return;
+    if(deadline_ns == UINT64_MAX && animator->deadline_ns == 0) return;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if(deadline_ns != UINT64_MAX) {
+        its.it_value.tv_sec = deadline_ns / 1000000000ULL;
+        its.it_value.tv_nsec = deadline_ns % 1000000000ULL;
+    }
+    timerfd_settime(animator->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    animator->deadline_ns = deadline_ns == UINT64_MAX ? 0 : deadline_ns;
+}
+
+static void animate(struct light_animator *animator, uint64_t now_ns) {
+    uint64_t frame = (now_ns / animator->frame_ns + 1) * animator->frame_ns;
+    uint64_t next = UINT64_MAX;
+    for(auto it = animator->anims.begin(); it != animator->anims.end();) {
+        struct light_anim& anim = it->second;
+        uint32_t color;
+        uint64_t until;
+        bool done = anim_eval(&anim, now_ns - anim.start_ns, &color, &until);
+        if(color != anim.color) {
+            anim.color = color;
+            if(!send_color(animator, anim.pattern, color)) done = true;
+        }
+        if(done) {
+            it = animator->anims.erase(it);
+            continue;
+        }
+        uint64_t deadline = until ? anim.start_ns + until : frame;
+        if(deadline < next) next = deadline;
+        ++it;
+    }
+    arm(animator, next);
+}
+
+bool light_animator_init(struct light_animator *animator, const struct light_backend *backend, int fps) {
+    animator->backend = backend;
+    animator->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    animator->frame_ns = 1000000000ULL / (fps > 0 ? fps : LIGHTS_PATTERN_FPS);
+    animator->deadline_ns = 0;
+    animator->anims.clear();
+    animator->wakeups = 0;
+    animator->frames = 0;
+    animator->writes = 0;
+    return animator->timer_fd != -1;
+}
+
+bool light_animator_start(struct light_animator *animator, const struct light_pattern& pattern, uint64_t now_ns) {
+    struct light_anim anim;
+    anim.pattern = pattern;
+    anim.start_ns = now_ns;
+    anim.length_ns = 0;
+    for(size_t i = pattern.loop ? 0 : 1; i < pattern.keys.size(); i++)
+        anim.length_ns += pattern.keys[i].ms * 1000000ULL;
+
+    uint64_t until;
+    anim_eval(&anim, 0, &anim.color, &until);
+    if(!send_color(animator, pattern, anim.color)) {
+        light_animator_stop(animator, pattern.type);
+        return false;
+    }
+    animator->anims[pattern.type] = anim;
+    animate(animator, now_ns);
+    return true;
+}
+
+bool light_animator_stop(struct light_animator *animator, const std::string& type) {
+    if(animator->anims.erase(type) == 0) return false;
+    if(animator->anims.empty()) arm(animator, UINT64_MAX);
+    return true;
+}
+
+void light_animator_run(struct light_animator *animator, uint64_t now_ns) {
+    uint64_t expirations;
+    if(read(animator->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    animator->wakeups++;
+    animator->frames += animator->anims.size();
+    // Armed once, it has fired
+    animator->deadline_ns = 0;
+    animate(animator, now_ns);
+}
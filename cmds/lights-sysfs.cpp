@@ -0,0 +1,163 @@
+#include "lights.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Writes the backlight and LED class devices directly, for HALs that add
+ * tens of ms per call. Nodes are looked up once, their brightness files
+ * stay open, and a value is only written when it differs from what the
+ * node holds. That is read back before every write, the vendor's own
+ * light HAL keeps writing the same nodes.
+ */
+
+// Where rw-system.sh and the devices we know keep the panel backlight
+static const char *backlight_dirs[] = {
+    "/sys/class/backlight/panel0-backlight",
+    "/sys/class/leds/lcd-backlight",
+    "/sys/class/lcd/panel/device/backlight/panel",
+};
+
+struct sysfs_node {
+    int fd;
+    int max;
+    bool readable;
+};
+
+struct sysfs_light {
+    std::string type;
+    // One node, or red, green and blue
+    std::vector<struct sysfs_node*> nodes;
+};
+
+// By directory, the RGB LED backs several types
+static std::map<std::string, struct sysfs_node> nodes;
+static std::vector<struct sysfs_light> lights;
+
+static int read_int(int fd) {
+    char buf[16];
+    ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+    if(len <= 0) return -1;
+    buf[len] = 0;
+    return atoi(buf);
+}
+
+static bool open_node(const std::string& dir, struct sysfs_node *node) {
+    node->fd = -1;
+    int max_fd = open((dir + "/max_brightness").c_str(), O_RDONLY | O_CLOEXEC);
+    if(max_fd == -1) return false;
+    node->max = read_int(max_fd);
+    close(max_fd);
+
+    std::string path = dir + "/brightness";
+    node->fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    node->readable = node->fd != -1;
+    if(node->fd == -1)
+        node->fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    return node->fd != -1 && node->max > 0;
+}
+
+static void add_light(const std::string& type, const std::vector<std::string>& dirs) {
+    struct sysfs_light light;
+    light.type = type;
+    for(const auto& dir: dirs) {
+        auto it = nodes.find(dir);
+        if(it == nodes.end()) {
+            struct sysfs_node node;
+            if(!open_node(dir, &node)) {
+                if(node.fd != -1) close(node.fd);
+                return;
+            }
+            it = nodes.emplace(dir, node).first;
+        }
+        light.nodes.push_back(&it->second);
+    }
+    lights.push_back(light);
+}
+
+static bool sysfs_connect() {
+    std::string backlight;
+    for(const char *dir: backlight_dirs) {
+        if(access(dir, F_OK) == 0) {
+            backlight = dir;
+            break;
+        }
+    }
+    if(backlight.empty()) {
+        DIR *d = opendir("/sys/class/backlight");
+        struct dirent *de;
+        while(d && (de = readdir(d)) != NULL) {
+            if(de->d_name[0] == '.') continue;
+            backlight = std::string("/sys/class/backlight/") + de->d_name;
+            break;
+        }
+        if(d) closedir(d);
+    }
+    if(!backlight.empty()) add_light("BACKLIGHT", { backlight });
+
+    add_light("BUTTONS", { "/sys/class/leds/button-backlight" });
+    add_light("KEYBOARD", { "/sys/class/leds/keyboard-backlight" });
+    // The notification LED of legacy lights HALs. Unlike them, there is no
+    // priority between the three: whichever was set last is what shows
+    std::vector<std::string> rgb = { "/sys/class/leds/red", "/sys/class/leds/green", "/sys/class/leds/blue" };
+    add_light("NOTIFICATIONS", rgb);
+    add_light("BATTERY", rgb);
+    add_light("ATTENTION", rgb);
+    return !lights.empty();
+}
+
+static void sysfs_get_types(std::vector<std::string> *types) {
+    for(const auto& light: lights)
+        types->push_back(light.type);
+}
+
+static bool write_node(struct sysfs_node *node, int value, std::string *status) {
+    // A read is much cheaper than a write, which goes through the driver
+    if(node->readable && read_int(node->fd) == value) return true;
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%d\n", value);
+    if(pwrite(node->fd, buf, len, 0) != len) {
+        *status = strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+static bool sysfs_set(const struct light_cmd *cmd, std::string *status) {
+    struct sysfs_light *light = NULL;
+    for(auto& l: lights) {
+        if(l.type == cmd->type) light = &l;
+    }
+    if(!light) return false;
+
+    int r = (cmd->color >> 16) & 0xff;
+    int g = (cmd->color >> 8) & 0xff;
+    int b = cmd->color & 0xff;
+    *status = cmd->flash == LIGHTS_FLASH_NONE ? "SUCCESS" : "SUCCESS, flash ignored, use PATTERN";
+    if(light->nodes.size() == 1) {
+        // Same weights as the legacy lights HALs
+        int brightness = (77 * r + 150 * g + 29 * b) >> 8;
+        struct sysfs_node *node = light->nodes[0];
+        return write_node(node, (brightness * node->max + 127) / 255, status);
+    }
+    int channels[3] = { r, g, b };
+    for(int i = 0; i < 3; i++) {
+        struct sysfs_node *node = light->nodes[i];
+        if(!write_node(node, (channels[i] * node->max + 127) / 255, status)) return false;
+    }
+    return true;
+}
+
+const struct light_backend lights_sysfs_backend = {
+    .name = "sysfs",
+    .extended_brightness = false,
+    .connect = sysfs_connect,
+    .get_types = sysfs_get_types,
+    .set = sysfs_set,
+    // Fast enough to ramp the backlight at display refresh
+    .pattern_fps = 60,
+};
@@ -0,0 +1,476 @@
+#include "lights.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <iostream>
+#include <map>
+#include <cutils/sockets.h>
+
+/*
+ * Daemon mode, "<tool> daemon [-v] [socket]", looks the HAL up and lists
+ * its types once, then serves lightsctl clients on a SOCK_SEQPACKET
+ * socket. lightsctl<suffix>.rc starts it with the default socket, created
+ * by init. A client sends one packet per batch, one command per line, and
+ * gets one packet back with a line per command:
+ *   OK <HAL status>  applied
+ *   COALESCED        a later command for the same light replaced it
+ *   ERR <reason>
+ * A packet holding just "TYPES" gets the supported types, one per line.
+ * Packets are at most LIGHTS_MSG_MAX bytes both ways, a bigger batch gets
+ * a single ERR line.
+ * Patterns run in the daemon, off its own epoll loop.
+ *
+ * Commands from every client with something pending are collected before
+ * any is applied, so a burst of updates to one light costs one HAL call.
+ * They are applied in the order they came in, the one that replaced
+ * earlier ones for its light taking the place of the last: types may share
+ * an LED, and then that order decides what shows. For the same reason
+ * the daemon doesn't skip a command that repeats a light's state, only a
+ * backend that knows what its types share can.
+ */
+
+#define LIGHTS_MSG_MAX 4096
+#define LIGHTS_MAX_EVENTS 16
+
+static std::vector<std::string> split(const std::string& s, const char *sep) {
+    std::vector<std::string> out;
+    size_t pos = 0;
+    while(pos < s.size()) {
+        size_t end = s.find_first_of(sep, pos);
+        if(end == std::string::npos) end = s.size();
+        if(end > pos) out.push_back(s.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return out;
+}
+
+bool light_cmd_parse(const struct light_backend *backend, const std::vector<std::string>& args,
+        struct light_cmd *cmd, std::string *error) {
+    size_t n = backend->extended_brightness ? 3 : 2;
+    if(args.size() != n && args.size() != n + 3) {
+        *error = std::string("expected TYPE COLOR ") + (backend->extended_brightness ? "EXT " : "") +
+            "[FLASH ON_MS OFF_MS]";
+        return false;
+    }
+    cmd->type = args[0];
+    cmd->color = (uint32_t)strtoll(args[1].c_str(), NULL, 16);
+    cmd->ext = backend->extended_brightness ? (uint32_t)strtoll(args[2].c_str(), NULL, 0) : 0;
+    cmd->flash = LIGHTS_FLASH_NONE;
+    cmd->on_ms = 0;
+    cmd->off_ms = 0;
+    if(args.size() == n) return true;
+
+    const std::string& flash = args[n];
+    if(flash == "NONE") {
+        cmd->flash = LIGHTS_FLASH_NONE;
+    } else if(flash == "TIMED") {
+        cmd->flash = LIGHTS_FLASH_TIMED;
+    } else if(flash == "HARDWARE") {
+        cmd->flash = LIGHTS_FLASH_HARDWARE;
+    } else {
+        *error = "unknown flash mode " + flash;
+        return false;
+    }
+    cmd->on_ms = atoi(args[n + 1].c_str());
+    cmd->off_ms = atoi(args[n + 2].c_str());
+    return true;
+}
+
+// One line of a request
+struct lights_line {
+    bool is_pattern;
+    struct light_cmd cmd;
+    struct light_pattern pattern;
+};
+
+static bool parse_line(const struct light_backend *backend, const std::string& line, struct lights_line *out,
+        std::string *error) {
+    std::vector<std::string> args = split(line, " \t");
+    out->is_pattern = !args.empty() && args[0] == "PATTERN";
+    if(!out->is_pattern)
+        return light_cmd_parse(backend, args, &out->cmd, error);
+    args.erase(args.begin());
+    // EXT isn't animated, but a 0 would turn the light off on these HALs
+    uint32_t ext = 0;
+    if(backend->extended_brightness) {
+        if(args.size() < 2) {
+            *error = "expected PATTERN TYPE EXT ...";
+            return false;
+        }
+        ext = (uint32_t)strtoll(args[1].c_str(), NULL, 0);
+        args.erase(args.begin() + 1);
+    }
+    if(!light_pattern_parse(args, &out->pattern, error)) return false;
+    out->pattern.ext = ext;
+    out->cmd.type = out->pattern.type;
+    return true;
+}
+
+static std::string default_socket(const struct light_backend *backend) {
+    const char *env = getenv("LIGHTSD_SOCKET");
+    if(env) return env;
+    return std::string("/dev/socket/lightsd-") + backend->name;
+}
+
+static bool make_addr(const std::string& path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr->sun_path)) return false;
+    strcpy(addr->sun_path, path.c_str());
+    return true;
+}
+
+struct lights_request {
+    int fd;
+    std::vector<std::string> replies;
+};
+
+struct lights_slot {
+    struct lights_line parsed;
+    size_t request;
+    size_t line;
+    bool coalesced;
+};
+
+// The commands of one round, in arrival order. Only the last one per light is applied
+struct lights_round {
+    std::vector<struct lights_slot> slots;
+    std::map<std::string, size_t> last;
+};
+
+static void daemon_collect(const struct light_backend *backend, const std::vector<std::string>& types,
+        int fd, const char *msg, size_t len, std::vector<struct lights_request> *requests,
+        struct lights_round *round) {
+    requests->push_back({ fd, {} });
+    size_t request = requests->size() - 1;
+    std::vector<std::string>& replies = requests->back().replies;
+
+    std::vector<std::string> lines = split(std::string(msg, len), "\n");
+    if(lines.size() == 1 && lines[0] == "TYPES") {
+        for(const auto& type: types)
+            replies.push_back(type);
+        return;
+    }
+    for(const auto& line: lines) {
+        struct lights_line parsed;
+        std::string error;
+        if(!parse_line(backend, line, &parsed, &error)) {
+            replies.push_back("ERR " + error);
+            continue;
+        }
+        const std::string& type = parsed.cmd.type;
+        auto it = round->last.find(type);
+        if(it != round->last.end()) {
+            struct lights_slot& prev = round->slots[it->second];
+            prev.coalesced = true;
+            (*requests)[prev.request].replies[prev.line] = "COALESCED";
+        }
+        round->last[type] = round->slots.size();
+        round->slots.push_back({ parsed, request, replies.size(), false });
+        replies.push_back("");
+    }
+}
+
+static int lights_daemon_main(int argc, char **argv, const struct light_backend *backend) {
+    std::string path = default_socket(backend);
+    bool verbose = false;
+    int fps = backend->pattern_fps;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-v") == 0) verbose = true;
+        else if(strcmp(argv[i], "-f") == 0 && i + 1 < argc) fps = atoi(argv[++i]);
+        else path = argv[i];
+    }
+
+    if(!backend->connect()) {
+        fprintf(stderr, "No light HAL\n");
+        return 1;
+    }
+    std::vector<std::string> types;
+    backend->get_types(&types);
+    struct light_animator animator;
+    if(!light_animator_init(&animator, backend, fps)) return 1;
+
+    // The one init made for us, already labeled
+    int listen_fd = -1;
+    if(path == default_socket(backend))
+        listen_fd = android_get_control_socket((std::string("lightsd-") + backend->name).c_str());
+    if(listen_fd != -1) {
+        fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+        if(listen(listen_fd, 16) < 0) {
+            perror("Couldn't listen on lightsd socket");
+            return 1;
+        }
+    } else {
+        struct sockaddr_un addr;
+        if(!make_addr(path, &addr)) return 1;
+        listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        unlink(path.c_str());
+        if(listen_fd == -1 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0) {
+            perror("Couldn't listen on lightsd socket");
+            return 1;
+        }
+        chmod(path.c_str(), 0666);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ee;
+    ee.events = EPOLLIN;
+    ee.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ee);
+    ee.data.fd = animator.timer_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, animator.timer_fd, &ee);
+
+    char buffer[LIGHTS_MSG_MAX];
+    while(1) {
+        struct epoll_event events[LIGHTS_MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, LIGHTS_MAX_EVENTS, -1);
+        if(n < 0 && errno != EINTR) return 1;
+
+        std::vector<struct lights_request> requests;
+        struct lights_round round;
+        for(int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if(fd == listen_fd) {
+                int client;
+                while((client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+                    ee.events = EPOLLIN;
+                    ee.data.fd = client;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &ee);
+                }
+                continue;
+            }
+            if(fd == animator.timer_fd) {
+                light_animator_run(&animator, lights_now_ns());
+                continue;
+            }
+            while(1) {
+                // With MSG_TRUNC, the length the packet had before it got cut
+                ssize_t len = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT | MSG_TRUNC);
+                if(len > (ssize_t)sizeof(buffer)) {
+                    requests.push_back({ fd, { "ERR batch over " + std::to_string(LIGHTS_MSG_MAX) + " bytes" } });
+                    continue;
+                }
+                if(len > 0) {
+                    daemon_collect(backend, types, fd, buffer, len, &requests, &round);
+                    continue;
+                }
+                if(len == 0 || errno != EAGAIN) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+                    close(fd);
+                    // Nobody left to answer
+                    for(auto& request: requests)
+                        if(request.fd == fd) request.fd = -1;
+                }
+                break;
+            }
+        }
+
+        for(const auto& slot: round.slots) {
+            if(slot.coalesced) continue;
+            const std::string& type = slot.parsed.cmd.type;
+            const struct light_cmd& cmd = slot.parsed.cmd;
+            std::string& reply = requests[slot.request].replies[slot.line];
+            // Whatever the pattern left is not something we asked for
+            light_animator_stop(&animator, type);
+            if(slot.parsed.is_pattern) {
+                if(light_animator_start(&animator, slot.parsed.pattern, lights_now_ns())) reply = "OK pattern";
+                else reply = "ERR unknown type " + type;
+                continue;
+            }
+            std::string status;
+            if(!backend->set(&cmd, &status)) {
+                reply = "ERR " + (status.empty() ? "unknown type " + type : status);
+                continue;
+            }
+            reply = "OK " + status;
+        }
+        if(verbose && !round.last.empty())
+            fprintf(stderr, "%zu requests, %zu lights\n", requests.size(), round.last.size());
+
+        for(const auto& request: requests) {
+            if(request.fd == -1) continue;
+            std::string reply;
+            for(const auto& line: request.replies)
+                reply += line + "\n";
+            if(reply.size() > LIGHTS_MSG_MAX)
+                reply = "ERR reply over " + std::to_string(LIGHTS_MSG_MAX) + " bytes\n";
+            send(request.fd, reply.data(), reply.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+    }
+}
+
+// Returns -1 if there is no daemon
+static int lights_connect(const std::string& path) {
+    struct sockaddr_un addr;
+    if(!make_addr(path, &addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd == -1) return -1;
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char *argv0, const struct light_backend *backend) {
+    const char *ext = backend->extended_brightness ? " EXT" : "";
+    fprintf(stderr, "Usage: %s [--sysfs] [-s socket] [-d] [TYPE COLOR%s [FLASH ON_MS OFF_MS]]\n", argv0, ext);
+    fprintf(stderr, "       %s [--sysfs] [-s socket] [-d] -b < commands\n", argv0);
+    fprintf(stderr, "       %s [--sysfs] [-s socket] [-d] PATTERN TYPE%s breathe|ramp|cycle|keys ...\n", argv0, ext);
+    fprintf(stderr, "       %s [--sysfs] daemon [-v] [-f fps] [socket]\n", argv0);
+    fprintf(stderr, "\tWithout a command, lists the supported types\n");
+    fprintf(stderr, "\t--sysfs\twrite the backlight and LEDs in sysfs instead of using the HAL\n");
+    fprintf(stderr, "\t-b\tone command per line from stdin, sent as one batch\n");
+    fprintf(stderr, "\t-d\ttalk to the HAL directly even if a daemon runs, a pattern then\n"
+            "\t\truns in the foreground\n");
+    fprintf(stderr, "\t-s\tdaemon socket, default $LIGHTSD_SOCKET or %s\n", default_socket(backend).c_str());
+}
+
+static int print_reply(const std::string& line) {
+    if(line == "OK pattern") {
+        std::cout << "Pattern started" << std::endl;
+        return 0;
+    }
+    if(line.compare(0, 3, "OK ") == 0) {
+        std::cout << "Set light returned " << line.substr(3) << std::endl;
+        return 0;
+    }
+    std::cout << line << std::endl;
+    return line.compare(0, 4, "ERR ") == 0 ? 1 : 0;
+}
+
+int lights_main(int argc, char **argv, const struct light_backend *backend) {
+    if(argc >= 2 && strcmp(argv[1], "--sysfs") == 0) {
+        backend = &lights_sysfs_backend;
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    if(argc >= 2 && strcmp(argv[1], "daemon") == 0)
+        return lights_daemon_main(argc - 1, argv + 1, backend);
+
+    std::string path = default_socket(backend);
+    bool batch = false;
+    bool direct = false;
+    int i = 1;
+    for(; i < argc && argv[i][0] == '-' && argv[i][1] != 0; i++) {
+        if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if(strcmp(argv[i], "-b") == 0) {
+            batch = true;
+        } else if(strcmp(argv[i], "-d") == 0) {
+            direct = true;
+        } else {
+            usage(argv[0], backend);
+            return 1;
+        }
+    }
+
+    std::vector<std::string> lines;
+    if(batch) {
+        std::string line;
+        while(std::getline(std::cin, line)) {
+            if(line.empty() || line[0] == '#') continue;
+            lines.push_back(line);
+        }
+    } else if(i < argc) {
+        std::string line;
+        for(; i < argc; i++)
+            line += std::string(line.empty() ? "" : " ") + argv[i];
+        lines.push_back(line);
+    }
+
+    // Reject malformed commands before anything is set
+    std::vector<struct lights_line> cmds;
+    for(const auto& line: lines) {
+        struct lights_line cmd;
+        std::string error;
+        if(!parse_line(backend, line, &cmd, &error)) {
+            fprintf(stderr, "%s: %s\n", line.c_str(), error.c_str());
+            usage(argv[0], backend);
+            return 1;
+        }
+        cmds.push_back(cmd);
+    }
+
+    int fd = direct ? -1 : lights_connect(path);
+    if(fd != -1) {
+        std::string request;
+        if(lines.empty()) request = "TYPES";
+        for(const auto& line: lines)
+            request += line + "\n";
+        char buffer[LIGHTS_MSG_MAX];
+        if(request.size() > sizeof(buffer)) {
+            fprintf(stderr, "Batch over %zu bytes, split it\n", sizeof(buffer));
+            close(fd);
+            return 1;
+        }
+        ssize_t len = -1;
+        if(send(fd, request.data(), request.size(), MSG_NOSIGNAL) >= 0)
+            len = recv(fd, buffer, sizeof(buffer), MSG_TRUNC);
+        close(fd);
+        if(len <= 0) {
+            fprintf(stderr, "lightsd didn't answer\n");
+            return 1;
+        }
+        if(len > (ssize_t)sizeof(buffer)) {
+            fprintf(stderr, "lightsd reply got truncated\n");
+            return 1;
+        }
+        int ret = 0;
+        for(const auto& line: split(std::string(buffer, len), "\n")) {
+            if(lines.empty()) std::cout << "Got type " << line << std::endl;
+            else ret |= print_reply(line);
+        }
+        return ret;
+    }
+
+    if(!backend->connect()) {
+        fprintf(stderr, "No light HAL\n");
+        return 1;
+    }
+    if(cmds.empty()) {
+        std::vector<std::string> types;
+        backend->get_types(&types);
+        for(const auto& type: types)
+            std::cout << "Got type " << type << std::endl;
+        return 0;
+    }
+    struct light_animator animator;
+    if(!light_animator_init(&animator, backend, backend->pattern_fps)) return 1;
+    int ret = 0;
+    for(const auto& cmd: cmds) {
+        light_animator_stop(&animator, cmd.cmd.type);
+        if(cmd.is_pattern) {
+            if(light_animator_start(&animator, cmd.pattern, lights_now_ns()))
+                ret |= print_reply("OK pattern");
+            else
+                ret |= print_reply("ERR unknown type " + cmd.cmd.type);
+            continue;
+        }
+        std::string status;
+        if(backend->set(&cmd.cmd, &status)) {
+            ret |= print_reply("OK " + status);
+        } else {
+            ret |= print_reply("ERR " + (status.empty() ? "unknown type " + cmd.cmd.type : status));
+        }
+    }
+
+    // Nobody else will animate, so stay until the patterns are over
+    while(!animator.anims.empty()) {
+        struct pollfd pfd = { animator.timer_fd, POLLIN, 0 };
+        if(poll(&pfd, 1, -1) < 0 && errno != EINTR) return 1;
+        light_animator_run(&animator, lights_now_ns());
+    }
+    return ret;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Shared by the lightsctl tools. Each tool only knows how to talk to its
+ * HAL, the command line, the daemon mode and its socket protocol live in
+ * lights.cpp.
+ *
+ * Command line, and one line of a daemon request:
+ *   TYPE COLOR [EXT] [FLASH ON_MS OFF_MS]
+ * TYPE is whatever the HAL calls it (BACKLIGHT, NOTIFICATIONS, a number
+ * for Huawei), COLOR is hex ARGB, EXT the extended brightness of HALs
+ * that have one, FLASH is NONE, TIMED or HARDWARE.
+ *
+ * Many HALs ignore FLASH, so lights can also be animated in software:
+ *   PATTERN TYPE breathe COLOR PERIOD_MS
+ *   PATTERN TYPE ramp FROM TO MS
+ *   PATTERN TYPE cycle MS COLOR...
+ *   PATTERN TYPE keys COLOR:MS...
+ * with EXT after TYPE for HALs that have one, held for the whole pattern.
+ * A pattern runs until it ends (ramp), or until that light is set again.
+ */
+
+#define LIGHTS_FLASH_NONE 0
+#define LIGHTS_FLASH_TIMED 1
+#define LIGHTS_FLASH_HARDWARE 2
+
+struct light_cmd {
+    std::string type;
+    uint32_t color;
+    uint32_t ext;
+    int flash;
+    int on_ms;
+    int off_ms;
+};
+
+struct light_backend {
+    const char *name; // default socket is /dev/socket/lightsd-<name>
+    bool extended_brightness; // takes EXT
+    // Looks the HAL up, once. Returns false if there is none
+    bool (*connect)();
+    void (*get_types)(std::vector<std::string> *types);
+    // Returns false if the HAL doesn't have that type, or with the reason in
+    // *status if it couldn't be set. Otherwise *status is the HAL's answer
+    bool (*set)(const struct light_cmd *cmd, std::string *status);
+    int pattern_fps; // 0 for LIGHTS_PATTERN_FPS
+};
+
+// Backlight and LED class devices, "--sysfs" before anything else picks it
+// instead of the tool's HAL
+extern const struct light_backend lights_sysfs_backend;
+
+#define LIGHTS_PATTERN_FPS 30
+#define LIGHTS_PATTERN_MAX_KEYS 32
+
+struct light_keyframe {
+    uint32_t color;
+    int ms; // to fade from the previous key, the last one for key 0 of a loop
+    bool smooth; // eases in and out instead of a linear fade
+};
+
+struct light_pattern {
+    std::string type;
+    uint32_t ext;
+    std::vector<struct light_keyframe> keys;
+    bool loop;
+};
+
+struct light_anim {
+    struct light_pattern pattern;
+    uint64_t start_ns;
+    uint64_t length_ns;
+    uint32_t color; // last one sent
+};
+
+/*
+ * Runs the patterns of one backend off a single timerfd. Frames are on a
+ * fixed grid shared by every light, a frame only reaches the HAL if the
+ * color changed, and the timer is disarmed while nothing is fading, so an
+ * idle animator never wakes up.
+ */
+struct light_animator {
+    const struct light_backend *backend;
+    int timer_fd;
+    uint64_t frame_ns;
+    uint64_t deadline_ns; // 0 when disarmed
+    std::map<std::string, struct light_anim> anims;
+    uint64_t wakeups;
+    uint64_t frames;
+    uint64_t writes;
+};
+
+static inline uint64_t lights_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns false on a malformed command, with the reason in *error
+bool light_cmd_parse(const struct light_backend *backend, const std::vector<std::string>& args,
+        struct light_cmd *cmd, std::string *error);
+
+// args start after PATTERN
+bool light_pattern_parse(const std::vector<std::string>& args, struct light_pattern *pattern, std::string *error);
+
+bool light_animator_init(struct light_animator *animator, const struct light_backend *backend, int fps);
+// Sends the first frame right away. Returns false if the HAL doesn't have that type
+bool light_animator_start(struct light_animator *animator, const struct light_pattern& pattern, uint64_t now_ns);
+// Returns false if no pattern ran on that light
+bool light_animator_stop(struct light_animator *animator, const std::string& type);
+// Call when timer_fd is readable
+void light_animator_run(struct light_animator *animator, uint64_t now_ns);
+
+int lights_main(int argc, char **argv, const struct light_backend *backend);
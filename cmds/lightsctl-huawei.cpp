@@ -1,38 +1,52 @@
-#include <iostream>
 #include <vendor/huawei/hardware/light/2.0/ILight.h>
 #include <android/hardware/light/2.0/types.h>
+#include "lights.h"
 
 using ::vendor::huawei::hardware::light::V2_0::ILight;
+using ::android::hardware::light::V2_0::LightState;
 using ::android::sp;
 
-int main(int argc, char **argv) {
-	auto svc = ILight::getService();
-	svc->HWgetSupportedTypes([](auto types) {
-		for(const auto& type: types) {
-			std::cout << "Got type " << type << std::endl;
-		}
+static sp<ILight> svc;
+
+static bool huawei_connect() {
+	svc = ILight::getService();
+	return svc != nullptr;
+}
+
+// Huawei types are plain numbers
+static void huawei_get_types(std::vector<std::string> *types) {
+	svc->HWgetSupportedTypes([types](auto supported) {
+		for(const auto& type: supported)
+			types->push_back(std::to_string(type));
 	});
+}
 
-	uint32_t a = (uint32_t)strtoll(argv[1], NULL, 10);
+static bool huawei_set(const struct light_cmd *cmd, std::string *status) {
+	char *end;
+	uint32_t type = (uint32_t)strtoll(cmd->type.c_str(), &end, 10);
+	if(cmd->type.empty() || *end != 0) return false;
 
-	android::hardware::light::V2_0::LightState state;
-	state.color = (uint32_t)strtoll(argv[2], NULL, 16);
-	state.flashMode = android::hardware::light::V2_0::Flash::NONE;
+	LightState state;
+	state.color = cmd->color;
+	state.flashMode = static_cast<android::hardware::light::V2_0::Flash>(cmd->flash);
+	state.flashOnMs = cmd->on_ms;
+	state.flashOffMs = cmd->off_ms;
 	state.brightnessMode = android::hardware::light::V2_0::Brightness::USER;
+	// Nothing to read back from HWsetLight but the transport status
+	auto ret = svc->HWsetLight(type, state);
+	*status = ret.isOk() ? "SUCCESS" : ret.description();
+	return true;
+}
 
-	if(argc == 6) {
-		std::string flashArg(argv[3]);
-		if(flashArg == "NONE")
-			state.flashMode = android::hardware::light::V2_0::Flash::NONE;
-		if(flashArg == "TIMED")
-			state.flashMode = android::hardware::light::V2_0::Flash::TIMED;
-		if(flashArg == "HARDWARE")
-			state.flashMode = android::hardware::light::V2_0::Flash::HARDWARE;
-
-		state.flashOnMs = atoi(argv[4]);
-		state.flashOffMs = atoi(argv[5]);
-	}
-	std::cout << "Set flash type to " << toString(state.flashMode) << std::endl;
-
-	svc->HWsetLight(a, state);
+static const struct light_backend huawei_backend = {
+	.name = "huawei",
+	.extended_brightness = false,
+	.connect = huawei_connect,
+	.get_types = huawei_get_types,
+	.set = huawei_set,
+	.pattern_fps = LIGHTS_PATTERN_FPS,
+};
+
+int main(int argc, char **argv) {
+	return lights_main(argc, argv, &huawei_backend);
 }
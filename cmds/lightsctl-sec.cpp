@@ -1,59 +1,52 @@
-#include <iostream>
 #include <vendor/samsung/hardware/light/2.0/ISecLight.h>
 #include <vendor/samsung/hardware/light/2.0/types.h>
+#include "lights.h"
 
 using ::vendor::samsung::hardware::light::V2_0::ISecLight;
+using ::vendor::samsung::hardware::light::V2_0::SecType;
+using ::android::hardware::light::V2_0::LightState;
+using ::android::hardware::hidl_enum_range;
 using ::android::sp;
 
-int main(int argc, char **argv) {
-	auto svc = ISecLight::getService();
-	svc->getSupportedTypes([](auto types) {
-		for(const auto& type: types) {
-			std::cout << "Got type " << toString(type) << std::endl;
-		}
+static sp<ISecLight> svc;
+
+static bool sec_connect() {
+	svc = ISecLight::getService();
+	return svc != nullptr;
+}
+
+static void sec_get_types(std::vector<std::string> *types) {
+	svc->getSupportedTypes([types](auto supported) {
+		for(const auto& type: supported)
+			types->push_back(toString(type));
 	});
-	if(argc <= 1) return 0;
-	if(argc != 3 && argc != 6) return 1;
-
-	std::string typeArg(argv[1]);
-	vendor::samsung::hardware::light::V2_0::SecType type;
-	if(typeArg == "BACKLIGHT")
-		type = vendor::samsung::hardware::light::V2_0::SecType::BACKLIGHT;
-	if(typeArg == "KEYBOARD")
-		type = vendor::samsung::hardware::light::V2_0::SecType::KEYBOARD;
-	if(typeArg == "BUTTONS")
-		type = vendor::samsung::hardware::light::V2_0::SecType::BUTTONS;
-	if(typeArg == "BATTERY")
-		type = vendor::samsung::hardware::light::V2_0::SecType::BATTERY;
-	if(typeArg == "NOTIFICATIONS")
-		type = vendor::samsung::hardware::light::V2_0::SecType::NOTIFICATIONS;
-	if(typeArg == "ATTENTION")
-		type = vendor::samsung::hardware::light::V2_0::SecType::ATTENTION;
-	if(typeArg == "BLUETOOTH")
-		type = vendor::samsung::hardware::light::V2_0::SecType::BLUETOOTH;
-	if(typeArg == "WIFI")
-		type = vendor::samsung::hardware::light::V2_0::SecType::WIFI;
-	std::cout << "Set request type " << toString(type) << std::endl;
-
-	android::hardware::light::V2_0::LightState state;
-	state.color = (uint32_t)strtoll(argv[2], NULL, 16);
-	state.flashMode = android::hardware::light::V2_0::Flash::NONE;
-	state.brightnessMode = android::hardware::light::V2_0::Brightness::USER;
-
-	if(argc == 6) {
-		std::string flashArg(argv[3]);
-		if(flashArg == "NONE")
-			state.flashMode = android::hardware::light::V2_0::Flash::NONE;
-		if(flashArg == "TIMED")
-			state.flashMode = android::hardware::light::V2_0::Flash::TIMED;
-		if(flashArg == "HARDWARE")
-			state.flashMode = android::hardware::light::V2_0::Flash::HARDWARE;
-
-		state.flashOnMs = atoi(argv[4]);
-		state.flashOffMs = atoi(argv[5]);
+}
+
+static bool sec_set(const struct light_cmd *cmd, std::string *status) {
+	for(auto type: hidl_enum_range<SecType>()) {
+		if(toString(type) != cmd->type) continue;
+
+		LightState state;
+		state.color = cmd->color;
+		state.flashMode = static_cast<android::hardware::light::V2_0::Flash>(cmd->flash);
+		state.flashOnMs = cmd->on_ms;
+		state.flashOffMs = cmd->off_ms;
+		state.brightnessMode = android::hardware::light::V2_0::Brightness::USER;
+		*status = toString(svc->setLightSec(type, state));
+		return true;
 	}
-	std::cout << "Set flash type to " << toString(state.flashMode) << std::endl;
+	return false;
+}
 
-	auto ret = svc->setLightSec(type, state);
-	std::cout << "Set light returned " << toString(ret) << std::endl;
+static const struct light_backend sec_backend = {
+	.name = "sec",
+	.extended_brightness = false,
+	.connect = sec_connect,
+	.get_types = sec_get_types,
+	.set = sec_set,
+	.pattern_fps = LIGHTS_PATTERN_FPS,
+};
+
+int main(int argc, char **argv) {
+	return lights_main(argc, argv, &sec_backend);
 }
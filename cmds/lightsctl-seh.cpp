@@ -1,62 +1,53 @@
-#include <iostream>
 #include <vendor/samsung/hardware/light/3.0/ISehLight.h>
 #include <vendor/samsung/hardware/light/3.0/types.h>
+#include "lights.h"
 
 using ::vendor::samsung::hardware::light::V3_0::ISehLight;
+using ::vendor::samsung::hardware::light::V3_0::SehLightState;
+using ::vendor::samsung::hardware::light::V3_0::SehType;
+using ::android::hardware::hidl_enum_range;
 using ::android::sp;
 
-int main(int argc, char **argv) {
-	auto svc = ISehLight::getService();
-	svc->getSupportedTypes([](auto types) {
-		for(const auto& type: types) {
-			std::cout << "Got type " << toString(type) << std::endl;
-		}
+static sp<ISehLight> svc;
+
+static bool seh_connect() {
+	svc = ISehLight::getService();
+	return svc != nullptr;
+}
+
+static void seh_get_types(std::vector<std::string> *types) {
+	svc->getSupportedTypes([types](auto supported) {
+		for(const auto& type: supported)
+			types->push_back(toString(type));
 	});
-	if(argc <= 1) return 0;
-	if(argc != 4 && argc != 7) return 1;
-
-	std::string typeArg(argv[1]);
-	vendor::samsung::hardware::light::V3_0::SehType type;
-	if(typeArg == "BACKLIGHT")
-		type = vendor::samsung::hardware::light::V3_0::SehType::BACKLIGHT;
-	if(typeArg == "KEYBOARD")
-		type = vendor::samsung::hardware::light::V3_0::SehType::KEYBOARD;
-	if(typeArg == "BUTTONS")
-		type = vendor::samsung::hardware::light::V3_0::SehType::BUTTONS;
-	if(typeArg == "BATTERY")
-		type = vendor::samsung::hardware::light::V3_0::SehType::BATTERY;
-	if(typeArg == "NOTIFICATIONS")
-		type = vendor::samsung::hardware::light::V3_0::SehType::NOTIFICATIONS;
-	if(typeArg == "ATTENTION")
-		type = vendor::samsung::hardware::light::V3_0::SehType::ATTENTION;
-	if(typeArg == "BLUETOOTH")
-		type = vendor::samsung::hardware::light::V3_0::SehType::BLUETOOTH;
-	if(typeArg == "WIFI")
-		type = vendor::samsung::hardware::light::V3_0::SehType::WIFI;
-	if(typeArg == "SUB_BACKLIGHT")
-		type = vendor::samsung::hardware::light::V3_0::SehType::SUB_BACKLIGHT;
-	std::cout << "Set request type " << toString(type) << std::endl;
-
-	vendor::samsung::hardware::light::V3_0::SehLightState state;
-	state.color = (uint32_t)strtoll(argv[2], NULL, 16);
-	state.flashMode = android::hardware::light::V2_0::Flash::NONE;
-	state.brightnessMode = android::hardware::light::V2_0::Brightness::USER;
-	state.extendedBrightness = (uint32_t)strtoll(argv[3], NULL, 0);
-
-	if(argc == 7) {
-		std::string flashArg(argv[4]);
-		if(flashArg == "NONE")
-			state.flashMode = android::hardware::light::V2_0::Flash::NONE;
-		if(flashArg == "TIMED")
-			state.flashMode = android::hardware::light::V2_0::Flash::TIMED;
-		if(flashArg == "HARDWARE")
-			state.flashMode = android::hardware::light::V2_0::Flash::HARDWARE;
-
-		state.flashOnMs = atoi(argv[5]);
-		state.flashOffMs = atoi(argv[6]);
+}
+
+static bool seh_set(const struct light_cmd *cmd, std::string *status) {
+	for(auto type: hidl_enum_range<SehType>()) {
+		if(toString(type) != cmd->type) continue;
+
+		SehLightState state;
+		state.color = cmd->color;
+		state.flashMode = static_cast<android::hardware::light::V2_0::Flash>(cmd->flash);
+		state.flashOnMs = cmd->on_ms;
+		state.flashOffMs = cmd->off_ms;
+		state.brightnessMode = android::hardware::light::V2_0::Brightness::USER;
+		state.extendedBrightness = cmd->ext;
+		*status = toString(svc->sehSetLight(type, state));
+		return true;
 	}
-	std::cout << "Set flash type to " << toString(state.flashMode) << std::endl;
+	return false;
+}
 
-	auto ret = svc->sehSetLight(type, state);
-	std::cout << "Set light returned " << toString(ret) << std::endl;
+static const struct light_backend seh_backend = {
+	.name = "seh",
+	.extended_brightness = true,
+	.connect = seh_connect,
+	.get_types = seh_get_types,
+	.set = seh_set,
+	.pattern_fps = LIGHTS_PATTERN_FPS,
+};
+
+int main(int argc, char **argv) {
+	return lights_main(argc, argv, &seh_backend);
 }
@@ -1,59 +1,52 @@
-#include <iostream>
 #include <android/hardware/light/2.0/ILight.h>
 #include <android/hardware/light/2.0/types.h>
+#include "lights.h"
 
 using ::android::hardware::light::V2_0::ILight;
+using ::android::hardware::light::V2_0::LightState;
+using ::android::hardware::light::V2_0::Type;
+using ::android::hardware::hidl_enum_range;
 using ::android::sp;
 
-int main(int argc, char **argv) {
-	auto svc = ILight::getService();
-	svc->getSupportedTypes([](auto types) {
-		for(const auto& type: types) {
-			std::cout << "Got type " << toString(type) << std::endl;
-		}
+static sp<ILight> svc;
+
+static bool aosp_connect() {
+	svc = ILight::getService();
+	return svc != nullptr;
+}
+
+static void aosp_get_types(std::vector<std::string> *types) {
+	svc->getSupportedTypes([types](auto supported) {
+		for(const auto& type: supported)
+			types->push_back(toString(type));
 	});
-	if(argc <= 1) return 0;
-	if(argc != 3 && argc != 6) return 1;
-
-	std::string typeArg(argv[1]);
-	android::hardware::light::V2_0::Type type;
-	if(typeArg == "BACKLIGHT")
-		type = android::hardware::light::V2_0::Type::BACKLIGHT;
-	if(typeArg == "KEYBOARD")
-		type = android::hardware::light::V2_0::Type::KEYBOARD;
-	if(typeArg == "BUTTONS")
-		type = android::hardware::light::V2_0::Type::BUTTONS;
-	if(typeArg == "BATTERY")
-		type = android::hardware::light::V2_0::Type::BATTERY;
-	if(typeArg == "NOTIFICATIONS")
-		type = android::hardware::light::V2_0::Type::NOTIFICATIONS;
-	if(typeArg == "ATTENTION")
-		type = android::hardware::light::V2_0::Type::ATTENTION;
-	if(typeArg == "BLUETOOTH")
-		type = android::hardware::light::V2_0::Type::BLUETOOTH;
-	if(typeArg == "WIFI")
-		type = android::hardware::light::V2_0::Type::WIFI;
-	std::cout << "Set request type " << toString(type) << std::endl;
-
-	android::hardware::light::V2_0::LightState state;
-	state.color = (uint32_t)strtoll(argv[2], NULL, 16);
-	state.flashMode = android::hardware::light::V2_0::Flash::NONE;
-	state.brightnessMode = android::hardware::light::V2_0::Brightness::USER;
-
-	if(argc == 6) {
-		std::string flashArg(argv[3]);
-		if(flashArg == "NONE")
-			state.flashMode = android::hardware::light::V2_0::Flash::NONE;
-		if(flashArg == "TIMED")
-			state.flashMode = android::hardware::light::V2_0::Flash::TIMED;
-		if(flashArg == "HARDWARE")
-			state.flashMode = android::hardware::light::V2_0::Flash::HARDWARE;
-
-		state.flashOnMs = atoi(argv[4]);
-		state.flashOffMs = atoi(argv[5]);
+}
+
+static bool aosp_set(const struct light_cmd *cmd, std::string *status) {
+	for(auto type: hidl_enum_range<Type>()) {
+		if(toString(type) != cmd->type) continue;
+
+		LightState state;
+		state.color = cmd->color;
+		state.flashMode = static_cast<android::hardware::light::V2_0::Flash>(cmd->flash);
+		state.flashOnMs = cmd->on_ms;
+		state.flashOffMs = cmd->off_ms;
+		state.brightnessMode = android::hardware::light::V2_0::Brightness::USER;
+		*status = toString(svc->setLight(type, state));
+		return true;
 	}
-	std::cout << "Set flash type to " << toString(state.flashMode) << std::endl;
+	return false;
+}
 
-	auto ret = svc->setLight(type, state);
-	std::cout << "Set light returned " << toString(ret) << std::endl;
+static const struct light_backend aosp_backend = {
+	.name = "aosp",
+	.extended_brightness = false,
+	.connect = aosp_connect,
+	.get_types = aosp_get_types,
+	.set = aosp_set,
+	.pattern_fps = LIGHTS_PATTERN_FPS,
+};
+
+int main(int argc, char **argv) {
+	return lights_main(argc, argv, &aosp_backend);
 }
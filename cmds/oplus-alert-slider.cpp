@@ -6,49 +6,400 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <time.h>
 #include <linux/input.h>
+#include <mutex>
+
+#define LOG_TAG "oplus-alert-slider"
+#include <log/log.h>
+
+#include <binder/IBinder.h>
+#include <binder/IServiceManager.h>
+#include <binder/Parcel.h>
+#include <binder/ProcessState.h>
+
+using android::IBinder;
+using android::Parcel;
+using android::sp;
+using android::String16;
+using android::wp;
+
+// IAudioService.setRingerModeExternal(int, String), what "service call audio 31" used to do
+#define AUDIO_SET_RINGER_MODE_EXTERNAL (IBinder::FIRST_CALL_TRANSACTION + 30)
+
+// Keeps the audio service binder around, and drops it when system_server dies
+// so that the next call looks it up again
+struct AudioService : public IBinder::DeathRecipient {
+    std::mutex lock;
+    sp<IBinder> binder;
+    String16 descriptor;
+
+    sp<IBinder> get(String16& desc) {
+        std::lock_guard<std::mutex> l(lock);
+        if(binder == nullptr) {
+            binder = android::defaultServiceManager()->getService(String16("audio"));
+            if(binder == nullptr) return nullptr;
+            descriptor = binder->getInterfaceDescriptor();
+            binder->linkToDeath(this);
+        }
+        desc = descriptor;
+        return binder;
+    }
+
+    void binderDied(const wp<IBinder>&) override {
+        ALOGW("Audio service died");
+        std::lock_guard<std::mutex> l(lock);
+        binder = nullptr;
+    }
+
+    bool setRingerMode(int mode) {
+        // Second try is for when system_server died before we got notified
+        for(int i = 0; i < 2; i++) {
+            String16 desc;
+            sp<IBinder> b = get(desc);
+            if(b == nullptr) return false;
+            Parcel data, reply;
+            data.writeInterfaceToken(desc);
+            data.writeInt32(mode);
+            data.writeString16(String16("android"));
+            android::status_t ret = b->transact(AUDIO_SET_RINGER_MODE_EXTERNAL, data, &reply);
+            // A SecurityException from AudioService still is a successful transaction
+            if(ret != android::DEAD_OBJECT) return ret == android::OK && reply.readExceptionCode() == 0;
+            std::lock_guard<std::mutex> l(lock);
+            if(binder == b) binder = nullptr;
+        }
+        return false;
+    }
+};
+
+static sp<AudioService> audio;
+
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Log-linear histogram of microseconds: 4 linear buckets per power of two
+struct latency_histogram {
+    const char *name;
+    uint32_t buckets[256];
+    uint32_t count;
+    uint64_t sum;
+    uint64_t max;
+
+    static int index(uint64_t v) {
+        if(v < 4) return v;
+        int msb = 63 - __builtin_clzll(v);
+        return (msb - 1) * 4 + ((v >> (msb - 2)) & 3);
+    }
+
+    static uint64_t lower_bound(int idx) {
+        if(idx < 4) return idx;
+        int msb = idx / 4 + 1;
+        return (uint64_t)(4 + idx % 4) << (msb - 2);
+    }
+
+    void add(uint64_t us) {
+        buckets[index(us)]++;
+        count++;
+        sum += us;
+        if(us > max) max = us;
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t target = count * p;
+        uint64_t seen = 0;
+        for(int i = 0; i < 256; i++) {
+            seen += buckets[i];
+            if(seen > target) return lower_bound(i);
+        }
+        return max;
+    }
+
+    void dump() const {
+        if(!count) {
+            ALOGI("%s: no samples", name);
+            return;
+        }
+        ALOGI("%s: n=%u avg=%lluus p50=%lluus p90=%lluus p99=%lluus max=%lluus", name, count,
+                (unsigned long long)(sum / count), (unsigned long long)percentile(.5),
+                (unsigned long long)percentile(.9), (unsigned long long)percentile(.99),
+                (unsigned long long)max);
+        for(int i = 0; i < 256; i++) {
+            if(buckets[i])
+                ALOGI("%s:   >= %lluus: %u", name, (unsigned long long)lower_bound(i), buckets[i]);
+        }
+    }
+};
+
+// kernel timestamp -> read wake-up -> tri_state read -> ringer change acked
+static struct latency_histogram hist_wake = { "kernel->wakeup", {}, 0, 0, 0 };
+static struct latency_histogram hist_state = { "wakeup->tri_state", {}, 0, 0, 0 };
+static struct latency_histogram hist_ack = { "tri_state->ringer ack", {}, 0, 0, 0 };
+static struct latency_histogram hist_total = { "kernel->ringer ack", {}, 0, 0, 0 };
+
+static void dump_stats() {
+    hist_wake.dump();
+    hist_state.dump();
+    hist_ack.dump();
+    hist_total.dump();
+}
+
+// ATrace-compatible markers, enabled with --trace
+static int trace_fd = -1;
+
+static void trace_begin(const char *name) {
+    if(trace_fd == -1) return;
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "B|%d|%s", getpid(), name);
+    write(trace_fd, buf, len);
+}
+
+static void trace_end() {
+    if(trace_fd == -1) return;
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "E|%d", getpid());
+    write(trace_fd, buf, len);
+}
+
+static void trace_counter(const char *name, uint64_t value) {
+    if(trace_fd == -1) return;
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "C|%d|%s|%llu", getpid(), name, (unsigned long long)value);
+    write(trace_fd, buf, len);
+}
 
 int read_tristate() {
     int fd = open("/proc/tristatekey/tri_state", O_RDONLY);
+    if(fd == -1) return -1;
     char p[16];
     int ret = read(fd, p, sizeof(p) - 1);
+    close(fd);
+    if(ret < 0) return -1;
     p[ret] = 0;
     return atoi(p);
 }
 
-int main() {
-    int fd = -1;
-    for(int i=0; i<255; i++) {
-        char path[256];
-        snprintf(path, 256, "/dev/input/event%d", i);
-        fd = open(path, O_RDWR);
-        if(fd == -1) continue;
-        char name[256];
-        ioctl(fd, EVIOCGNAME(256), name);
-        printf("Got input name %s\n", name);
-        if(strcmp(name, "oplus,hall_tri_state_key") == 0) {
-            break;
-        }
+static void tristate_action(const struct input_event& ev, uint64_t wake_ns) {
+    uint64_t kernel_ns = (uint64_t)ev.input_event_sec * 1000000000ULL + ev.input_event_usec * 1000ULL;
+
+    trace_begin("tri_state read");
+    int state = read_tristate();
+    trace_end();
+    uint64_t state_ns = now_ns();
+    ALOGI("State %d", state);
+    int mode = -1;
+    if(state == 1) {
+        mode = 2;
+    } else if(state == 2) {
+        mode = 1;
+    } else if(state == 3) {
+        mode = 0;
+    }
+    if(mode == -1) return;
+
+    trace_begin("setRingerMode");
+    bool ok = audio->setRingerMode(mode);
+    trace_end();
+    if(!ok) {
+        ALOGE("Failed setting ringer mode %d", mode);
+        return;
+    }
+    uint64_t ack_ns = now_ns();
+
+    // Clock mismatch (kernel not honouring EVIOCSCLOCKID) would give garbage
+    if(kernel_ns <= wake_ns && wake_ns - kernel_ns < 10000000000ULL) {
+        hist_wake.add((wake_ns - kernel_ns) / 1000);
+        hist_total.add((ack_ns - kernel_ns) / 1000);
+        trace_counter("slider_latency_us", (ack_ns - kernel_ns) / 1000);
+    }
+    hist_state.add((state_ns - wake_ns) / 1000);
+    hist_ack.add((ack_ns - state_ns) / 1000);
+}
+
+// Input devices we handle, matched by name, or by having a key in their
+// capabilities when name is NULL, and what to do on their events
+struct key_action {
+    const char *name;
+    int capability_key;
+    int code;
+    int value;
+    void (*action)(const struct input_event& ev, uint64_t wake_ns);
+};
+
+static const struct key_action key_actions[] = {
+    { "oplus,hall_tri_state_key", -1, 61, 0, tristate_action },
+};
+
+#define N_KEY_ACTIONS (sizeof(key_actions) / sizeof(key_actions[0]))
+#define MAX_DEVICES 8
+
+struct device {
+    int fd;
+    char node[32];
+    bool actions[N_KEY_ACTIONS];
+};
+
+static struct device devices[MAX_DEVICES];
+static int epoll_fd;
+
+static bool test_bit(const unsigned long *bits, int bit) {
+    return bits[bit / (8 * sizeof(long))] & (1UL << (bit % (8 * sizeof(long))));
+}
+
+static void open_device(const char *node) {
+    if(strncmp(node, "event", 5) != 0) return;
+    struct device *slot = NULL;
+    for(auto& d: devices) {
+        if(d.fd != -1 && strcmp(d.node, node) == 0) return;
+        if(d.fd == -1 && !slot) slot = &d;
+    }
+    if(!slot) return;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/input/%s", node);
+    int fd = open(path, O_RDWR | O_CLOEXEC | O_NONBLOCK);
+    if(fd == -1) return;
+    char name[256] = { 0 };
+    ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name);
+    unsigned long keys[KEY_CNT / (8 * sizeof(long)) + 1] = { 0 };
+    ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys);
+    ALOGI("Got input name %s", name);
+
+    bool matched = false;
+    for(size_t i = 0; i < N_KEY_ACTIONS; i++) {
+        const struct key_action& a = key_actions[i];
+        slot->actions[i] = a.name ? strcmp(name, a.name) == 0 :
+            (a.capability_key >= 0 && test_bit(keys, a.capability_key));
+        matched |= slot->actions[i];
+    }
+    if(!matched) {
         close(fd);
-        fd = -1;
+        return;
     }
-    if(fd == -1) return 0;
 
     ioctl(fd, EVIOCGRAB, 1);
+    // Same clock as ours, so that event timestamps can be compared
+    int clock = CLOCK_MONOTONIC;
+    ioctl(fd, EVIOCSCLOCKID, &clock);
+    slot->fd = fd;
+    strncpy(slot->node, node, sizeof(slot->node) - 1);
+    struct epoll_event ee;
+    ee.events = EPOLLIN;
+    ee.data.ptr = slot;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ee);
+}
 
-    struct input_event ev;
-    while(read(fd, &ev, sizeof(ev)) != 0) {
-        if(!(ev.code == 61 && ev.value == 0)) continue;
-        int state = read_tristate();
-        if(state == 1) {
+static void close_device(struct device *d) {
+    ALOGI("Lost input %s", d->node);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, d->fd, NULL);
+    close(d->fd);
+    d->fd = -1;
+}
+
+static void handle_device(struct device *d) {
+    struct input_event evs[16];
+    ssize_t len;
+    uint64_t wake_ns = now_ns();
+    while((len = read(d->fd, evs, sizeof(evs))) > 0) {
+        for(size_t n = 0; n < len / sizeof(evs[0]); n++) {
+            const struct input_event& ev = evs[n];
+            for(size_t i = 0; i < N_KEY_ACTIONS; i++) {
+                const struct key_action& a = key_actions[i];
+                if(d->actions[i] && ev.code == a.code && ev.value == a.value)
+                    a.action(ev, wake_ns);
+            }
         }
-        printf("State %d\n", read_tristate());
-        if(state == 1) {
-            system("service call audio 31 i32 2 s16 android");
-        } else if(state == 2) {
-            system("service call audio 31 i32 1 s16 android");
-        } else if(state == 3) {
-            system("service call audio 31 i32 0 s16 android");
+    }
+    // Device went away, e.g. driver reload
+    if(len == 0 || (len < 0 && errno != EAGAIN))
+        close_device(d);
+}
+
+int main(int argc, char **argv) {
+    if(argc >= 2 && strcmp(argv[1], "--trace") == 0) {
+        trace_fd = open("/sys/kernel/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+        if(trace_fd == -1)
+            trace_fd = open("/sys/kernel/debug/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+    }
+
+    // SIGUSR1 dumps the latency histograms. It is blocked before any binder
+    // thread exists so that they all inherit the mask, and read from the loop.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+    for(auto& d: devices)
+        d.fd = -1;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    // Devices showing up late, or coming back after a driver reload. Nodes
+    // may be created before ueventd fixes their permissions, hence IN_ATTRIB.
+    int inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    inotify_add_watch(inotify_fd, "/dev/input", IN_CREATE | IN_ATTRIB);
+    struct epoll_event ee;
+    ee.events = EPOLLIN;
+    ee.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ee);
+    ee.data.ptr = &signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ee);
+
+    DIR *dir = opendir("/dev/input");
+    if(dir) {
+        struct dirent *de;
+        while((de = readdir(dir)) != NULL)
+            open_device(de->d_name);
+        closedir(dir);
+    }
+
+    bool found = false;
+    for(auto& d: devices)
+        found |= d.fd != -1;
+    // Not an Oplus device, don't hang around
+    if(!found && access("/proc/tristatekey/tri_state", F_OK) != 0) return 0;
+
+    // Needed to get death notifications
+    android::ProcessState::self()->startThreadPool();
+    audio = new AudioService();
+
+    while(1) {
+        struct epoll_event events[MAX_DEVICES + 2];
+        int n = epoll_wait(epoll_fd, events, MAX_DEVICES + 2, -1);
+        if(n < 0 && errno != EINTR) return 1;
+        for(int i = 0; i < n; i++) {
+            if(events[i].data.ptr == &signal_fd) {
+                struct signalfd_siginfo si;
+                while(read(signal_fd, &si, sizeof(si)) == sizeof(si))
+                    dump_stats();
+                continue;
+            }
+            if(events[i].data.ptr) {
+                handle_device((struct device*)events[i].data.ptr);
+                continue;
+            }
+            char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len;
+            while((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+                for(char *p = buf; p < buf + len; ) {
+                    struct inotify_event *iev = (struct inotify_event*)p;
+                    if(iev->len) open_device(iev->name);
+                    p += sizeof(struct inotify_event) + iev->len;
+                }
+            }
         }
     }
 }
@@ -1,55 +1,648 @@
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "device/phh/treble/cmds/persistent_properties.pb.h"
 #include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+static void usage(const char *argv0) {
+	std::cout << "Usage: " << argv0 << " [prop value]" << std::endl;
+	std::cout << "       " << argv0 << " -g prop" << std::endl;
+	std::cout << "       " << argv0 << " -l" << std::endl;
+	std::cout << "       " << argv0 << " -w" << std::endl;
+	std::cout << "       " << argv0 << " -d prop" << std::endl;
+	std::cout << "       " << argv0 << " -b [file]" << std::endl;
+	std::cout << "Batch mode reads one edit per line, from file or stdin:" << std::endl;
+	std::cout << "\tset <prop> <value>" << std::endl;
+	std::cout << "\tdel <prop>" << std::endl;
+	std::cout << "       " << argv0 << " --bench [props]" << std::endl;
+}
+
+/*
+ * Reads the file straight from the protobuf wire format, without building
+ * PersistentProperties: every record is
+ *   0x0a <varint len> { 0x0a <varint len> name  0x12 <varint len> value }
+ * Names and values point into the buffer, nothing is allocated.
+ */
+struct WireRecord {
+	std::string_view name;
+	std::string_view value;
+	// Byte range of the whole record, tag included
+	size_t begin;
+	size_t end;
+};
+
+class WireScanner {
+public:
+	WireScanner(const char *data, size_t size) : mData((const uint8_t*)data), mSize(size) {}
+
+	// Returns false at the end of the buffer, or on malformed input
+	bool next(WireRecord& record) {
+		while(mOffset < mSize) {
+			size_t begin = mOffset;
+			uint64_t tag, len;
+			if(!varint(mOffset, mSize, tag)) return fail();
+			if(tag != ((1 << 3) | 2)) {
+				// Not a record, skip it
+				if(!skip(mOffset, mSize, tag)) return fail();
+				continue;
+			}
+			if(!varint(mOffset, mSize, len) || len > mSize - mOffset) return fail();
+			size_t end = mOffset + len;
+			record.name = std::string_view();
+			record.value = std::string_view();
+			while(mOffset < end) {
+				uint64_t field, flen;
+				if(!varint(mOffset, end, field)) return fail();
+				if((field & 7) != 2) {
+					if(!skip(mOffset, end, field)) return fail();
+					continue;
+				}
+				if(!varint(mOffset, end, flen) || flen > end - mOffset) return fail();
+				std::string_view v((const char*)mData + mOffset, flen);
+				if(field >> 3 == 1) record.name = v;
+				else if(field >> 3 == 2) record.value = v;
+				mOffset += flen;
+			}
+			record.begin = begin;
+			record.end = end;
+			return true;
+		}
+		return false;
+	}
+
+	bool failed() const { return mFailed; }
+
+private:
+	bool fail() {
+		mFailed = true;
+		return false;
+	}
+
+	bool varint(size_t& off, size_t end, uint64_t& v) {
+		v = 0;
+		for(int shift = 0; shift < 64 && off < end; shift += 7) {
+			uint8_t b = mData[off++];
+			v |= (uint64_t)(b & 0x7f) << shift;
+			if(!(b & 0x80)) return true;
+		}
+		return false;
+	}
+
+	bool skip(size_t& off, size_t end, uint64_t tag) {
+		uint64_t v;
+		switch(tag & 7) {
+			case 0: return varint(off, end, v);
+			case 1: off += 8; return off <= end;
+			case 2:
+				if(!varint(off, end, v) || v > end - off) return false;
+				off += v;
+				return true;
+			case 5: off += 4; return off <= end;
+			default: return false;
+		}
+	}
+
+	const uint8_t *mData;
+	size_t mSize;
+	size_t mOffset = 0;
+	bool mFailed = false;
+};
+
+struct MappedFile {
+	const char *data = nullptr;
+	size_t size = 0;
+
+	bool map(int fd) {
+		struct stat st;
+		if(fstat(fd, &st) < 0) return false;
+		size = st.st_size;
+		if(size == 0) return true;
+		void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p == MAP_FAILED) return false;
+		data = (const char*)p;
+		return true;
+	}
+
+	~MappedFile() {
+		if(data) munmap((void*)data, size);
+	}
+};
+
+static int countRecords(const char *data, size_t size) {
+	WireScanner scanner(data, size);
+	WireRecord record;
+	int n = 0;
+	while(scanner.next(record)) n++;
+	return n;
+}
+
+static int listRecords(const char *data, size_t size) {
+	WireScanner scanner(data, size);
+	WireRecord record;
+	while(scanner.next(record)) {
+		fwrite(record.name.data(), 1, record.name.size(), stdout);
+		fputc(':', stdout);
+		fwrite(record.value.data(), 1, record.value.size(), stdout);
+		fputc('\n', stdout);
+	}
+	if(scanner.failed()) {
+		std::cerr << "Malformed persistent_properties" << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+// The whole file, up to its end
+static bool validRecords(const char *data, size_t size) {
+	WireScanner scanner(data, size);
+	WireRecord record;
+	while(scanner.next(record));
+	return !scanner.failed();
+}
+
+// Stops at the first match
+static bool findRecord(const char *data, size_t size, std::string_view name, WireRecord& record) {
+	WireScanner scanner(data, size);
+	while(scanner.next(record)) {
+		if(record.name == name) return true;
+	}
+	return false;
+}
+
+static uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Compares the full protobuf parse with the wire scanner on a synthetic file
+static int bench(int nProps) {
+	PersistentProperties props;
+	for(int i = 0; i < nProps; i++) {
+		auto *record = props.add_properties();
+		record->set_name("persist.vendor.bench.prop" + std::to_string(i));
+		record->set_value(std::to_string(i * 7919));
+	}
+	std::string buffer;
+	props.SerializeToString(&buffer);
+	std::string last = "persist.vendor.bench.prop" + std::to_string(nProps - 1);
+	const int rounds = 20;
+
+	uint64_t start = nowNs();
+	size_t found = 0;
+	for(int r = 0; r < rounds; r++) {
+		PersistentProperties parsed;
+		parsed.ParseFromArray(buffer.data(), buffer.size());
+		auto& p = parsed.properties();
+		auto it = std::find_if(p.begin(), p.end(), [&](const auto& v) { return v.name() == last; });
+		found += it != p.end();
+	}
+	uint64_t parseNs = (nowNs() - start) / rounds;
+
+	start = nowNs();
+	for(int r = 0; r < rounds; r++) {
+		WireRecord record;
+		found += findRecord(buffer.data(), buffer.size(), last, record);
+	}
+	uint64_t scanNs = (nowNs() - start) / rounds;
+
+	start = nowNs();
+	size_t bytes = 0;
+	for(int r = 0; r < rounds; r++) {
+		WireScanner scanner(buffer.data(), buffer.size());
+		WireRecord record;
+		while(scanner.next(record)) bytes += record.name.size() + record.value.size();
+	}
+	uint64_t listNs = (nowNs() - start) / rounds;
+
+	std::cout << nProps << " props, " << buffer.size() << " bytes (" << found << "/" << bytes << ")" << std::endl;
+	std::cout << "full parse + find_if (last): " << parseNs / 1000 << " us" << std::endl;
+	std::cout << "wire scan get (last):        " << scanNs / 1000 << " us" << std::endl;
+	std::cout << "wire scan list:              " << listNs / 1000 << " us" << std::endl;
+	return 0;
+}
+
+/*
+ * Previous version of the file, keyed by name. Only value hashes are
+ * kept, a collision there at worst hides one change.
+ */
+struct WatchEntry {
+	size_t valueHash;
+	unsigned generation;
+};
+
+static void diffRecords(std::unordered_map<std::string, WatchEntry>& index, unsigned generation,
+		const char *data, size_t size, bool report) {
+	std::hash<std::string_view> hash;
+	WireScanner scanner(data, size);
+	WireRecord record;
+	time_t now = time(nullptr);
+	char stamp[32];
+	strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+	// Reused across records, so that lookups don't allocate
+	std::string name;
+	while(scanner.next(record)) {
+		name.assign(record.name.data(), record.name.size());
+		size_t valueHash = hash(record.value);
+		auto it = index.find(name);
+		if(it == index.end()) {
+			index.emplace(name, WatchEntry{valueHash, generation});
+			if(report) std::cout << stamp << " + " << record.name << "=" << record.value << std::endl;
+			continue;
+		}
+		it->second.generation = generation;
+		if(it->second.valueHash == valueHash) continue;
+		it->second.valueHash = valueHash;
+		if(report) std::cout << stamp << " ~ " << record.name << "=" << record.value << std::endl;
+	}
+	for(auto it = index.begin(); it != index.end(); ) {
+		if(it->second.generation == generation) {
+			++it;
+			continue;
+		}
+		if(report) std::cout << stamp << " - " << it->first << std::endl;
+		it = index.erase(it);
+	}
+}
+
+static bool loadForWatch(std::unordered_map<std::string, WatchEntry>& index, unsigned generation, bool report) {
+	int fd = open("persistent_properties", O_RDONLY | O_CLOEXEC);
+	if(fd == -1) return false;
+	MappedFile file;
+	bool ok = file.map(fd);
+	close(fd);
+	if(ok) diffRecords(index, generation, file.data, file.size, report);
+	return ok;
+}
+
+// Watches the directory rather than the file, init replaces it with a rename
+static int watch() {
+	int in = inotify_init1(IN_CLOEXEC);
+	if(in == -1 || inotify_add_watch(in, ".", IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) == -1) {
+		std::cerr << "Can't watch current directory" << std::endl;
+		return -1;
+	}
+	std::unordered_map<std::string, WatchEntry> index;
+	unsigned generation = 0;
+	loadForWatch(index, ++generation, false);
+	std::cout << "Watching " << index.size() << " props." << std::endl;
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while(1) {
+		ssize_t len = read(in, buf, sizeof(buf));
+		if(len <= 0) {
+			if(len < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		bool changed = false;
+		for(char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event*)p;
+			if(ev->len && strcmp(ev->name, "persistent_properties") == 0)
+				changed = true;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+		if(!changed) continue;
+		if(!loadForWatch(index, ++generation, true))
+			diffRecords(index, generation, nullptr, 0, true);
+	}
+}
+
+struct WriteStats {
+	size_t written = 0;
+	size_t copied = 0;
+};
+
+// Copies in the kernel when possible, so the untouched parts never go
+// through userspace
+static bool copyRange(int in, int out, off_t off, size_t len, WriteStats& stats) {
+	while(len > 0) {
+		loff_t inOff = off;
+		ssize_t r = syscall(__NR_copy_file_range, in, &inOff, out, nullptr, len, 0);
+		if(r <= 0) break;
+		off += r;
+		len -= r;
+		stats.copied += r;
+	}
+	char buf[65536];
+	while(len > 0) {
+		ssize_t r = pread(in, buf, std::min(len, sizeof(buf)), off);
+		if(r <= 0 || write(out, buf, r) != r) return false;
+		off += r;
+		len -= r;
+		stats.written += r;
+	}
+	return true;
+}
+
+/*
+ * Replaces persistent_properties with fd[0, prefix) + middle + fd[suffix, size)
+ * through persistent_properties.tmp, fsync and rename, like init does, so the
+ * file is never seen empty or half written.
+ */
+static bool replaceFile(int fd, size_t prefix, std::string_view middle, size_t suffix, size_t size, WriteStats& stats) {
+	struct stat st;
+	if(fstat(fd, &st) < 0) return false;
+	int tmp = open("persistent_properties.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+	if(tmp == -1) {
+		std::cerr << "Can't create persistent_properties.tmp" << std::endl;
+		return false;
+	}
+	fchown(tmp, st.st_uid, st.st_gid);
+	bool ok = copyRange(fd, tmp, 0, prefix, stats);
+	if(ok && !middle.empty()) {
+		ok = write(tmp, middle.data(), middle.size()) == (ssize_t)middle.size();
+		stats.written += middle.size();
+	}
+	ok = ok && copyRange(fd, tmp, suffix, size - suffix, stats);
+	ok = ok && fsync(tmp) == 0;
+	close(tmp);
+	if(!ok || rename("persistent_properties.tmp", "persistent_properties") < 0) {
+		std::cerr << "Failed writing persistent_properties" << std::endl;
+		unlink("persistent_properties.tmp");
+		return false;
+	}
+	int dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dir != -1) {
+		fsync(dir);
+		close(dir);
+	}
+	return true;
+}
+
+static void reportWrite(const WriteStats& stats) {
+	std::cout << "Wrote " << stats.written << " bytes";
+	if(stats.copied)
+		std::cout << ", " << stats.copied << " bytes copied by the kernel";
+	std::cout << "." << std::endl;
+}
+
+static bool save(int fd, PersistentProperties& props) {
+	std::string buffer;
+	props.SerializeToString(&buffer);
+	WriteStats stats;
+	if(!replaceFile(fd, 0, buffer, 0, 0, stats)) return false;
+	reportWrite(stats);
+	return true;
+}
+
+static void putVarint(std::string& out, uint64_t v) {
+	while(v >= 0x80) {
+		out.push_back((char)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((char)v);
+}
+
+static size_t varintSize(uint64_t v) {
+	size_t n = 1;
+	while(v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+// Same bytes as PersistentProperties would serialize the record to
+static std::string encodeRecord(std::string_view name, std::string_view value) {
+	size_t len = 1 + varintSize(name.size()) + name.size() + 1 + varintSize(value.size()) + value.size();
+	std::string out;
+	out.reserve(1 + varintSize(len) + len);
+	out.push_back(0x0a);
+	putVarint(out, len);
+	out.push_back(0x0a);
+	putVarint(out, name.size());
+	out.append(name);
+	out.push_back(0x12);
+	putVarint(out, value.size());
+	out.append(value);
+	return out;
+}
+
+/*
+ * Single edit without a full parse: find the record's byte range, and
+ * - patch it in place when the new record has the same size, the file size
+ *   doesn't change so it is never seen truncated
+ * - otherwise splice the new record (or nothing) between the untouched
+ *   prefix and suffix, into a new file
+ */
+static bool editInPlace(int fd, const char *data, size_t size, bool remove, std::string_view name, std::string_view value) {
+	WireRecord record;
+	bool found = findRecord(data, size, name, record);
+	if(!found && remove) {
+		std::cout << "Property not found" << std::endl;
+		return true;
+	}
+	std::string encoded = remove ? std::string() : encodeRecord(name, value);
+	WriteStats stats;
+	if(found && !remove && encoded.size() == record.end - record.begin) {
+		std::cout << "Property found, patching it in place" << std::endl;
+		if(pwrite(fd, encoded.data(), encoded.size(), record.begin) != (ssize_t)encoded.size() || fdatasync(fd) < 0) {
+			std::cerr << "Failed writing persistent_properties" << std::endl;
+			return false;
+		}
+		stats.written = encoded.size();
+	} else {
+		if(!found) {
+			std::cout << "Property not found, adding it" << std::endl;
+			record.begin = record.end = size;
+		} else {
+			std::cout << "Property found, " << (remove ? "removing" : "replacing") << " it" << std::endl;
+		}
+		if(!replaceFile(fd, record.begin, encoded, record.end, size, stats)) return false;
+	}
+	reportWrite(stats);
+	return true;
+}
+
+struct Edit {
+	bool remove;
+	std::string name;
+	std::string value;
+};
+
+static bool readEdits(std::istream& in, std::vector<Edit>& edits) {
+	std::string line;
+	int lineno = 0;
+	while(std::getline(in, line)) {
+		lineno++;
+		if(line.empty() || line[0] == '#') continue;
+		size_t cmdEnd = line.find(' ');
+		std::string cmd = line.substr(0, cmdEnd);
+		if(cmdEnd == std::string::npos) {
+			std::cerr << "Line " << lineno << ": missing property name" << std::endl;
+			return false;
+		}
+		size_t nameEnd = line.find(' ', cmdEnd + 1);
+		Edit edit;
+		edit.name = line.substr(cmdEnd + 1, nameEnd == std::string::npos ? std::string::npos : nameEnd - cmdEnd - 1);
+		if(cmd == "set" && nameEnd != std::string::npos) {
+			edit.remove = false;
+			// Value is the rest of the line, spaces included
+			edit.value = line.substr(nameEnd + 1);
+		} else if(cmd == "del" && nameEnd == std::string::npos) {
+			edit.remove = true;
+		} else {
+			std::cerr << "Line " << lineno << ": bad edit " << line << std::endl;
+			return false;
+		}
+		edits.push_back(std::move(edit));
+	}
+	return true;
+}
+
+// Applies all edits with one pass over the records, and a single rewrite
+static void applyEdits(PersistentProperties& props, const std::vector<Edit>& edits) {
+	auto p = props.mutable_properties();
+	std::unordered_map<std::string, int> index;
+	index.reserve(p->size() + edits.size());
+	for(int i = 0; i < p->size(); i++)
+		index[p->Get(i).name()] = i;
+
+	std::vector<bool> removed(p->size(), false);
+	int nSet = 0, nAdded = 0, nRemoved = 0;
+	for(const auto& edit: edits) {
+		auto it = index.find(edit.name);
+		if(edit.remove) {
+			if(it == index.end() || removed[it->second]) continue;
+			removed[it->second] = true;
+			nRemoved++;
+		} else if(it == index.end() || removed[it->second]) {
+			auto *record = p->Add();
+			record->set_name(edit.name);
+			record->set_value(edit.value);
+			index[edit.name] = p->size() - 1;
+			removed.push_back(false);
+			nAdded++;
+		} else {
+			p->Mutable(it->second)->set_value(edit.value);
+			nSet++;
+		}
+	}
+
+	if(nRemoved) {
+		// Compact in place, keeping the order of the remaining records
+		int out = 0;
+		for(int i = 0; i < p->size(); i++) {
+			if(removed[i]) continue;
+			if(out != i) p->SwapElements(out, i);
+			out++;
+		}
+		while(p->size() > out)
+			p->RemoveLast();
+	}
+	std::cout << "Replaced " << nSet << ", added " << nAdded << ", removed " << nRemoved << " props." << std::endl;
+}
 
 int main(int argc, char **argv) {
+	if(argc >= 2 && strcmp(argv[1], "--bench") == 0)
+		return bench(argc >= 3 ? atoi(argv[2]) : 10000);
+
+	if(argc == 2 && strcmp(argv[1], "-w") == 0)
+		return watch();
+
+	bool readOnly = argc == 1 ||
+		(argc == 2 && strcmp(argv[1], "-l") == 0) ||
+		(argc == 3 && strcmp(argv[1], "-g") == 0);
+	if(readOnly) {
+		int fd = open("persistent_properties", O_RDONLY);
+		MappedFile file;
+		if(fd == -1 || !file.map(fd)) {
+			std::cerr << "Can't read persistent_properties" << std::endl;
+			return -1;
+		}
+		close(fd);
+		if(argc == 3) {
+			WireRecord record;
+			if(!findRecord(file.data, file.size, argv[2], record)) return 1;
+			std::cout << record.value << std::endl;
+			return 0;
+		}
+		if(argc == 1)
+			std::cout << "Currently has " << countRecords(file.data, file.size) << " props." << std::endl;
+		return listRecords(file.data, file.size);
+	}
+
+	bool single = (argc == 3 && strcmp(argv[1], "-d") == 0) ||
+		(argc == 3 && argv[1][0] != '-');
+	if(single) {
+		int fd = open("persistent_properties", O_RDWR);
+		MappedFile file;
+		if(fd == -1 || !file.map(fd)) {
+			std::cerr << "Can't read persistent_properties" << std::endl;
+			return -1;
+		}
+		if(argv[1][0] != '-') {
+			std::cout << "Currently has " << countRecords(file.data, file.size) << " props." << std::endl;
+			listRecords(file.data, file.size);
+		}
+		if(!validRecords(file.data, file.size)) {
+			std::cerr << "Malformed persistent_properties, not touching it" << std::endl;
+			close(fd);
+			return -1;
+		}
+		bool remove = argv[1][0] == '-';
+		bool ok = editInPlace(fd, file.data, file.size, remove, argv[2 - !remove], remove ? "" : argv[2]);
+		close(fd);
+		return ok ? 0 : -1;
+	}
+
+	if(strcmp(argv[1], "-b") != 0 || argc > 3) {
+		usage(argv[0]);
+		return -1;
+	}
+
 	int fd = open("persistent_properties", O_RDWR);
+	if(fd == -1) {
+		std::cerr << "Can't read persistent_properties" << std::endl;
+		return -1;
+	}
 	off_t size = lseek(fd, 0, SEEK_END);
 	lseek(fd, 0, SEEK_SET);
 	char *data = (char*) malloc(size);
-	int ret = read(fd, data, size);
+	ssize_t len = read(fd, data, size);
 
+	// Saving what we failed to read would wipe every persistent property
 	PersistentProperties props;
-	bool parsed = props.ParseFromArray(data, size);
-	std::cout << "Currently has " << props.properties_size() << " props." << std::endl;
-	for(auto prop: props.properties()) {
-		std::cout << prop.name() << ":" << prop.value() << std::endl;
-	}
-
-	if(argc == 1) {
+	bool parsed = len == size && props.ParseFromArray(data, size);
+	free(data);
+	if(!parsed) {
+		std::cerr << (len == size ? "Malformed" : "Can't read") << " persistent_properties, not touching it" << std::endl;
 		close(fd);
-		return 0;
-	}
-	if(argc != 3) {
-		std::cout << "Usage: " << argv[0] << " [prop value]" << std::endl;
 		return -1;
 	}
+	std::cout << "Currently has " << props.properties_size() << " props." << std::endl;
 
-	std::string property(argv[1]);
-	std::string value(argv[2]);
-
-	auto p = props.mutable_properties();
-	auto it = std::find_if(p->begin(), p->end(), [=](const auto& v) { return v.name() == property; });
-	if(it == p->end()) {
-		std::cout << "Property not found, adding it" << std::endl;
-		auto *record = p->Add();;
-		record->set_name(property);
-		record->set_value(value);
+	std::vector<Edit> edits;
+	bool ok;
+	if(argc == 3 && strcmp(argv[2], "-") != 0) {
+		std::ifstream in(argv[2]);
+		if(!in) {
+			std::cerr << "Can't open " << argv[2] << std::endl;
+			return -1;
+		}
+		ok = readEdits(in, edits);
 	} else {
-		std::cout << "Property found, replacing it" << std::endl;
-		it->set_value(value);
+		ok = readEdits(std::cin, edits);
 	}
+	if(!ok) return -1;
 
-	size_t write_size = props.ByteSize();
-	char *write_buffer = (char*) malloc(write_size);
-	props.SerializeToArray(write_buffer, write_size);
-	ftruncate(fd, 0);
-	lseek(fd, 0, SEEK_SET);
-	write(fd, write_buffer, write_size);
+	applyEdits(props, edits);
+	ok = save(fd, props);
 	close(fd);
+	return ok ? 0 : -1;
 }
@@ -0,0 +1,293 @@
+#include "uevent.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+size_t uevent_synthesize(char *buf, size_t size, const char *devpath) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys%s/uevent", devpath);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) return 0;
+
+    int n = snprintf(buf, size, "add@%s%cACTION=add%cDEVPATH=%s%c", devpath, 0, 0, devpath, 0);
+    if(n < 0 || (size_t)n >= size) {
+        close(fd);
+        return 0;
+    }
+    size_t len = n;
+
+    // The uevent file doesn't carry SUBSYSTEM, the kernel adds it from the link
+    char link[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys%s/subsystem", devpath);
+    ssize_t l = readlink(path, link, sizeof(link) - 1);
+    if(l > 0) {
+        link[l] = 0;
+        const char *subsystem = strrchr(link, '/');
+        subsystem = subsystem ? subsystem + 1 : link;
+        n = snprintf(buf + len, size - len, "SUBSYSTEM=%s%c", subsystem, 0);
+        if(n > 0 && (size_t)n < size - len) len += n;
+    }
+
+    ssize_t r = read(fd, buf + len, size - len - 1);
+    close(fd);
+    if(r > 0) {
+        for(ssize_t i = 0; i < r; i++)
+            if(buf[len + i] == '\n') buf[len + i] = 0;
+        len += r;
+        // Drop the trailing NUL of the last line, like the kernel
+        if(buf[len - 1] == 0) len--;
+    }
+    buf[len] = 0;
+    return len;
+}
+
+/*
+ * Every worker owns a deque of directories to visit. It pushes and pops
+ * subdirectories at the back, so it walks depth-first and keeps its
+ * dentries hot, while idle workers steal whole subtrees from the front.
+ * A worker that found nothing to steal sleeps until something is pushed or
+ * the walk is over.
+ */
+struct worker {
+    std::mutex lock;
+    std::deque<std::string> queue;
+    int dirs = 0;
+    int events = 0;
+    int steals = 0;
+};
+
+struct walk {
+    const struct uevent_coldplug_opts *opts;
+    uevent_cb cb;
+    void *cookie;
+    std::mutex emit_lock;
+    std::atomic<int> pending{0};
+    std::vector<worker> workers;
+    // Bumped on every push, so a sleeping worker knows there may be work
+    std::atomic<uint64_t> pushes{0};
+    std::atomic<int> sleeping{0};
+    std::mutex idle_lock;
+    std::condition_variable idle;
+
+    walk(int n) : workers(n) {}
+};
+
+static bool excluded(const struct uevent_coldplug_opts *opts, const std::string& path) {
+    for(int i = 0; i < opts->n_exclude; i++) {
+        const char *ex = opts->exclude[i];
+        size_t l = strlen(ex);
+        while(l > 1 && ex[l - 1] == '/') l--;
+        if(path.size() == l && memcmp(path.data(), ex, l) == 0) return true;
+    }
+    return false;
+}
+
+static void wake(struct walk *w, bool all) {
+    if(w->sleeping == 0) return;
+    // Taking the lock orders us after a worker about to sleep checked pushes
+    { std::lock_guard<std::mutex> l(w->idle_lock); }
+    if(all) w->idle.notify_all();
+    else w->idle.notify_one();
+}
+
+static void push(struct walk *w, int id, std::string&& path) {
+    w->pending++;
+    {
+        std::lock_guard<std::mutex> l(w->workers[id].lock);
+        w->workers[id].queue.push_back(std::move(path));
+    }
+    w->pushes++;
+    wake(w, false);
+}
+
+static bool pop(struct walk *w, int id, std::string *path) {
+    {
+        struct worker& self = w->workers[id];
+        std::lock_guard<std::mutex> l(self.lock);
+        if(!self.queue.empty()) {
+            *path = std::move(self.queue.back());
+            self.queue.pop_back();
+            return true;
+        }
+    }
+    int n = w->workers.size();
+    for(int i = 1; i < n; i++) {
+        struct worker& victim = w->workers[(id + i) % n];
+        std::lock_guard<std::mutex> l(victim.lock);
+        if(!victim.queue.empty()) {
+            *path = std::move(victim.queue.front());
+            victim.queue.pop_front();
+            w->workers[id].steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void visit(struct walk *w, int id, const std::string& path, char *buf) {
+    struct worker& self = w->workers[id];
+    DIR *d = opendir(path.c_str());
+    if(!d) return;
+    self.dirs++;
+
+    // path is /sys/..., the devpath starts after /sys
+    if(faccessat(dirfd(d), "uevent", F_OK, 0) == 0) {
+        size_t len = uevent_synthesize(buf, UEVENT_MSG_SIZE + 1, path.c_str() + 4);
+        struct uevent ev;
+        if(len && uevent_parse(&ev, buf, len)) {
+            ev.ts_ns = uevent_now_ns();
+            std::lock_guard<std::mutex> l(w->emit_lock);
+            w->cb(&ev, w->cookie);
+            self.events++;
+        }
+    }
+
+    struct dirent *de;
+    while((de = readdir(d)) != NULL) {
+        // Never follow symlinks, /sys/devices is a tree without them
+        if(de->d_type != DT_DIR) continue;
+        if(de->d_name[0] == '.') continue;
+        std::string child = path + "/" + de->d_name;
+        if(child.size() >= PATH_MAX || excluded(w->opts, child)) continue;
+        push(w, id, std::move(child));
+    }
+    closedir(d);
+}
+
+static void run(struct walk *w, int id) {
+    char buf[UEVENT_MSG_SIZE + 1];
+    std::string path;
+    while(w->pending > 0) {
+        uint64_t pushes = w->pushes;
+        if(!pop(w, id, &path)) {
+            std::unique_lock<std::mutex> l(w->idle_lock);
+            w->sleeping++;
+            w->idle.wait(l, [w, pushes] { return w->pushes != pushes || w->pending == 0; });
+            w->sleeping--;
+            continue;
+        }
+        visit(w, id, path, buf);
+        // Children were pushed before this, so pending can't drop to 0 early
+        if(--w->pending == 0) wake(w, true);
+    }
+}
+
+int uevent_coldplug(const struct uevent_coldplug_opts *opts, uevent_cb cb, void *cookie,
+        struct uevent_coldplug_stats *stats) {
+    static const char *default_include = "/sys/devices";
+    const char *const *include = opts->n_include ? opts->include : &default_include;
+    int n_include = opts->n_include ? opts->n_include : 1;
+
+    int threads = opts->threads;
+    if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads <= 0) threads = 1;
+
+    uint64_t start = uevent_now_ns();
+    struct walk w(threads);
+    w.opts = opts;
+    w.cb = cb;
+    w.cookie = cookie;
+    for(int i = 0; i < n_include; i++) {
+        std::string root(include[i]);
+        while(root.size() > 5 && root.back() == '/') root.pop_back();
+        if(root.compare(0, 5, "/sys/") != 0 || excluded(opts, root)) continue;
+        push(&w, i % threads, std::move(root));
+    }
+
+    std::vector<std::thread> pool;
+    for(int i = 1; i < threads; i++)
+        pool.emplace_back(run, &w, i);
+    run(&w, 0);
+    for(auto& t: pool)
+        t.join();
+
+    int events = 0;
+    if(stats) memset(stats, 0, sizeof(*stats));
+    for(auto& worker: w.workers) {
+        events += worker.events;
+        if(!stats) continue;
+        stats->dirs += worker.dirs;
+        stats->steals += worker.steals;
+    }
+    if(stats) {
+        stats->events = events;
+        stats->threads = threads;
+        stats->elapsed_ns = uevent_now_ns() - start;
+    }
+    return events;
+}
+
+int uevent_coldplug(const char *root, uevent_cb cb, void *cookie) {
+    struct uevent_coldplug_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.include = &root;
+    opts.n_include = 1;
+    return uevent_coldplug(&opts, cb, cookie, NULL);
+}
+
+struct coldplug_output {
+    bool json;
+    struct uevent_filter filters[UEVENT_MAX_FILTERS];
+    int n_filters;
+    int matched;
+};
+
+static void print_event(const struct uevent *ev, void *cookie) {
+    struct coldplug_output *out = (struct coldplug_output*)cookie;
+    if(!uevent_match(out->filters, out->n_filters, ev)) return;
+    out->matched++;
+    if(out->json)
+        uevent_print_json(ev, stdout);
+    else
+        uevent_print_text(ev, stdout);
+}
+
+int uevent_coldplug_main(int argc, char **argv) {
+    const char *include[UEVENT_MAX_FILTERS];
+    const char *exclude[UEVENT_MAX_FILTERS];
+    struct uevent_coldplug_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.include = include;
+    opts.exclude = exclude;
+    struct coldplug_output out;
+    memset(&out, 0, sizeof(out));
+    bool quiet = false;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-j") == 0) out.json = true;
+        else if(strcmp(argv[i], "-q") == 0) quiet = true;
+        else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc) opts.threads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-i") == 0 && i + 1 < argc && opts.n_include < UEVENT_MAX_FILTERS)
+            include[opts.n_include++] = argv[++i];
+        else if(strcmp(argv[i], "-x") == 0 && i + 1 < argc && opts.n_exclude < UEVENT_MAX_FILTERS)
+            exclude[opts.n_exclude++] = argv[++i];
+        else if(argv[i][0] != '-' && out.n_filters < UEVENT_MAX_FILTERS)
+            uevent_filter_parse(&out.filters[out.n_filters++], argv[i]);
+        else {
+            fprintf(stderr, "Usage: uevent coldplug [-j] [-q] [-p threads] [-i subtree]... [-x subtree]... [filter...]\n");
+            fprintf(stderr, "\t-j\tprint events as NDJSON\n");
+            fprintf(stderr, "\t-q\tonly print the timing report\n");
+            fprintf(stderr, "\t-p\tnumber of walker threads (default: one per CPU)\n");
+            fprintf(stderr, "\t-i\twalk this subtree (default /sys/devices)\n");
+            fprintf(stderr, "\t-x\tskip this subtree\n");
+            return 1;
+        }
+    }
+
+    struct uevent_coldplug_stats stats;
+    uevent_coldplug(&opts, quiet ? [](const struct uevent *, void *) {} : print_event, &out, &stats);
+    fflush(stdout);
+    fprintf(stderr, "Walked %d directories, %d devices", stats.dirs, stats.events);
+    if(!quiet) fprintf(stderr, " (%d matched)", out.matched);
+    fprintf(stderr, " in %.3f ms with %d threads, %d steals\n",
+            stats.elapsed_ns / 1e6, stats.threads, stats.steals);
+    return 0;
+}
@@ -0,0 +1,283 @@
+#include "uevent.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <string>
+#ifdef __ANDROID__
+#include <sys/system_properties.h>
+#endif
+
+/*
+ * Rules file, one rule per line:
+ *   <match>... : <action> <args>...
+ *
+ * match is KEY=glob, KEY!=glob, or attr:NAME which requires /sys$DEVPATH/NAME
+ * to exist. Actions:
+ *   write <path> <value>    done in-process
+ *   setprop <name> <value>  done in-process
+ *   exec <binary> <args>... forked, not waited for
+ * Arguments are split on whitespace, $KEY and ${KEY} are replaced by the
+ * event value, $$ by $. Lines starting with # are ignored.
+ *
+ * Example:
+ *   ACTION=add attr:fts_gesture_mode : setprop persist.sys.phh.focaltech_node /sys$DEVPATH/fts_gesture_mode
+ */
+
+#define RULE_MAX_ARGS 16
+#define RULE_MAX_RULES 256
+
+enum rule_action { RULE_WRITE, RULE_SETPROP, RULE_EXEC };
+
+struct rule {
+    int line;
+    struct uevent_filter filters[UEVENT_MAX_FILTERS];
+    int n_filters;
+    const char *attrs[UEVENT_MAX_FILTERS];
+    int n_attrs;
+    enum rule_action action;
+    const char *args[RULE_MAX_ARGS + 1];
+    int n_args;
+};
+
+// Rules point into this, it is never modified after load
+static std::string rules_text;
+static struct rule rules[RULE_MAX_RULES];
+static int n_rules;
+static bool verbose;
+
+/*
+ * Parses the $KEY, ${KEY} or $$ at p. Returns where the reference ends, or
+ * NULL if a $ isn't followed by one. *key_len is 0 for $$.
+ */
+static const char *parse_ref(const char *p, const char **key, size_t *key_len) {
+    if(p[1] == '$') {
+        *key_len = 0;
+        return p + 2;
+    }
+    bool braces = p[1] == '{';
+    *key = p + 1 + braces;
+    const char *k = *key;
+    while((*k >= 'A' && *k <= 'Z') || (*k >= '0' && *k <= '9') || *k == '_') k++;
+    *key_len = k - *key;
+    if(*key_len == 0) return NULL;
+    if(braces && *k++ != '}') return NULL;
+    return k;
+}
+
+static bool load_rules(const char *file) {
+    FILE *f = fopen(file, "re");
+    if(!f) {
+        perror("Couldn't open rules file");
+        return false;
+    }
+    char tmp[4096];
+    size_t r;
+    while((r = fread(tmp, 1, sizeof(tmp), f)) > 0)
+        rules_text.append(tmp, r);
+    fclose(f);
+
+    char *text = &rules_text[0];
+    int line = 0;
+    while(*text) {
+        line++;
+        char *eol = strchr(text, '\n');
+        if(eol) *eol = 0;
+        char *next = eol ? eol + 1 : text + strlen(text);
+
+        struct rule parsed;
+        struct rule *rule = &parsed;
+        memset(rule, 0, sizeof(*rule));
+        rule->line = line;
+        bool in_action = false;
+        bool has_action = false;
+        bool empty = true;
+        char *save;
+        for(char *tok = strtok_r(text, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+            if(empty && tok[0] == '#') break;
+            empty = false;
+            if(!in_action) {
+                if(strcmp(tok, ":") == 0) {
+                    in_action = true;
+                } else if(strncmp(tok, "attr:", 5) == 0 && rule->n_attrs < UEVENT_MAX_FILTERS) {
+                    rule->attrs[rule->n_attrs++] = tok + 5;
+                } else if(strchr(tok, '=') && rule->n_filters < UEVENT_MAX_FILTERS) {
+                    uevent_filter_parse(&rule->filters[rule->n_filters++], tok);
+                } else {
+                    fprintf(stderr, "%s:%d: bad match %s\n", file, line, tok);
+                    return false;
+                }
+            } else if(!has_action) {
+                has_action = true;
+                if(strcmp(tok, "write") == 0) rule->action = RULE_WRITE;
+                else if(strcmp(tok, "setprop") == 0) rule->action = RULE_SETPROP;
+                else if(strcmp(tok, "exec") == 0) rule->action = RULE_EXEC;
+                else {
+                    fprintf(stderr, "%s:%d: unknown action %s\n", file, line, tok);
+                    return false;
+                }
+            } else {
+                if(rule->n_args == RULE_MAX_ARGS) {
+                    fprintf(stderr, "%s:%d: more than %d arguments\n", file, line, RULE_MAX_ARGS);
+                    return false;
+                }
+                for(const char *p = strchr(tok, '$'); p; p = strchr(p, '$')) {
+                    const char *key;
+                    size_t key_len;
+                    p = parse_ref(p, &key, &key_len);
+                    if(!p) {
+                        fprintf(stderr, "%s:%d: bad $ in %s, use $$ for a $\n", file, line, tok);
+                        return false;
+                    }
+                }
+                rule->args[rule->n_args++] = tok;
+            }
+        }
+        text = next;
+        if(empty) continue;
+
+        if(!has_action ||
+                (rule->action != RULE_EXEC && rule->n_args != 2) ||
+                (rule->action == RULE_EXEC && rule->n_args < 1)) {
+            fprintf(stderr, "%s:%d: bad rule\n", file, line);
+            return false;
+        }
+        if(n_rules == RULE_MAX_RULES) {
+            fprintf(stderr, "%s:%d: more than %d rules\n", file, line, RULE_MAX_RULES);
+            return false;
+        }
+        rules[n_rules++] = parsed;
+    }
+    return true;
+}
+
+// Replaces $KEY and ${KEY} by their value in the event. load_rules()
+// checked that every $ is a reference
+static bool expand(const char *tmpl, const struct uevent *ev, char *out, size_t size) {
+    size_t o = 0;
+    for(const char *p = tmpl; *p; ) {
+        const char *value = NULL;
+        size_t value_len = 0;
+        if(p[0] == '$') {
+            const char *key;
+            size_t key_len;
+            p = parse_ref(p, &key, &key_len);
+            value = key_len ? uevent_get(ev, key, key_len) : "$";
+            if(!value) value = "";
+            value_len = strlen(value);
+        } else {
+            value = p;
+            value_len = 1;
+            p++;
+        }
+        if(o + value_len >= size) return false;
+        memcpy(out + o, value, value_len);
+        o += value_len;
+    }
+    out[o] = 0;
+    return true;
+}
+
+static bool rule_match(const struct rule *rule, const struct uevent *ev) {
+    if(!uevent_match(rule->filters, rule->n_filters, ev)) return false;
+    if(rule->n_attrs == 0) return true;
+    const char *devpath = uevent_get(ev, "DEVPATH");
+    if(!devpath) return false;
+    char path[PATH_MAX];
+    for(int i = 0; i < rule->n_attrs; i++) {
+        snprintf(path, sizeof(path), "/sys%s/%s", devpath, rule->attrs[i]);
+        if(access(path, F_OK) != 0) return false;
+    }
+    return true;
+}
+
+static void rule_run(const struct rule *rule, const struct uevent *ev) {
+    static char args[RULE_MAX_ARGS][PATH_MAX];
+    char *argv[RULE_MAX_ARGS + 1];
+    for(int i = 0; i < rule->n_args; i++) {
+        if(!expand(rule->args[i], ev, args[i], sizeof(args[i]))) {
+            fprintf(stderr, "rule %d: argument %d too long\n", rule->line, i);
+            return;
+        }
+        argv[i] = args[i];
+    }
+    argv[rule->n_args] = NULL;
+    if(verbose)
+        fprintf(stderr, "rule %d matched %s\n", rule->line, ev->header);
+
+    switch(rule->action) {
+        case RULE_WRITE: {
+            int fd = open(argv[0], O_WRONLY | O_CLOEXEC);
+            if(fd == -1 || write(fd, argv[1], strlen(argv[1])) < 0)
+                fprintf(stderr, "rule %d: write %s failed: %s\n", rule->line, argv[0], strerror(errno));
+            if(fd != -1) close(fd);
+            break;
+        }
+        case RULE_SETPROP:
+#ifdef __ANDROID__
+            if(__system_property_set(argv[0], argv[1]) != 0)
+                fprintf(stderr, "rule %d: setprop %s failed\n", rule->line, argv[0]);
+#else
+            fprintf(stderr, "rule %d: setprop %s %s\n", rule->line, argv[0], argv[1]);
+#endif
+            break;
+        case RULE_EXEC: {
+            pid_t pid = fork();
+            if(pid == 0) {
+                execv(argv[0], argv);
+                _exit(127);
+            }
+            if(pid == -1)
+                fprintf(stderr, "rule %d: fork failed: %s\n", rule->line, strerror(errno));
+            break;
+        }
+    }
+}
+
+static void handle_event(const struct uevent *ev, void *) {
+    for(int i = 0; i < n_rules; i++) {
+        if(rule_match(&rules[i], ev))
+            rule_run(&rules[i], ev);
+    }
+}
+
+int uevent_daemon_main(int argc, char **argv) {
+    bool coldplug = true;
+    const char *file = NULL;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-n") == 0) coldplug = false;
+        else if(strcmp(argv[i], "-v") == 0) verbose = true;
+        else file = argv[i];
+    }
+    if(!file) {
+        fprintf(stderr, "Usage: uevent daemon [-n] [-v] <rules>\n");
+        fprintf(stderr, "\t-n\tdon't coldplug existing devices at startup\n");
+        fprintf(stderr, "\t-v\tlog matched rules\n");
+        return 1;
+    }
+    if(!load_rules(file)) return 1;
+
+    // Reap exec children automatically
+    signal(SIGCHLD, SIG_IGN);
+
+    // Listen before walking /sys so that nothing plugged during the walk is
+    // missed. Such a device may be seen twice, rules must be idempotent.
+    int fd = uevent_open_netlink(0xffffffff);
+    if(fd == -1) return 1;
+
+    if(coldplug) {
+        int n = uevent_coldplug("/sys/devices", handle_event, NULL);
+        if(verbose)
+            fprintf(stderr, "Coldplugged %d devices\n", n);
+    }
+
+    char buffer[UEVENT_MSG_SIZE + 1];
+    struct uevent ev;
+    while(1) {
+        int r = uevent_recv(fd, buffer, &ev);
+        if(r < 0) return 1;
+        if(r == 0) continue;
+        handle_event(&ev, NULL);
+    }
+}
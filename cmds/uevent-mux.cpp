@@ -0,0 +1,421 @@
+#include "uevent.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+/*
+ * One netlink socket, many subscribers. A subscriber connects to the
+ * SOCK_SEQPACKET socket and sends one registration message:
+ *   "UEVMUX1\0" ["ring=<slots>\0"] [filter\0]...
+ * and gets back "OK", along with a memfd and an eventfd when it asked for
+ * a ring.
+ *
+ * Without a ring, every matching event is sent as one packet holding the
+ * raw netlink payload. When the subscriber doesn't keep up, up to
+ * MUX_QUEUE_MAX events are queued on our side, then the oldest ones are
+ * dropped.
+ *
+ * With a ring, events are written to shared memory and the eventfd is
+ * bumped once per batch. The ring overwrites the oldest slots when the
+ * subscriber lags, which it notices through the slot sequence numbers.
+ * The subscriber only gets a read-only fd of the ring, and we never read
+ * anything back from it: the slot count and write head we use are our
+ * own copies, the shared header only publishes them.
+ */
+
+#define MUX_HELLO "UEVMUX1"
+#define MUX_QUEUE_MAX 256
+#define MUX_MAX_RING_SLOTS 4096
+#define MUX_MAX_EVENTS 32
+
+struct uevent_ring_slot {
+    // 2*n+1 while event n is being written, 2*n+2 once it is complete
+    std::atomic<uint64_t> seq;
+    uint64_t ts_ns;
+    uint32_t len;
+    char data[UEVENT_MSG_SIZE + 1];
+};
+
+struct uevent_ring {
+    uint32_t slots;
+    std::atomic<uint64_t> head; // next event number to be written
+    struct uevent_ring_slot slot[];
+};
+
+static size_t ring_size(uint32_t slots) {
+    return sizeof(struct uevent_ring) + slots * sizeof(struct uevent_ring_slot);
+}
+
+struct subscriber {
+    int fd = -1;
+    bool registered = false;
+    std::string filters_text;
+    struct uevent_filter filters[UEVENT_MAX_FILTERS];
+    int n_filters = 0;
+    struct uevent_ring *ring = NULL;
+    uint32_t ring_slots = 0;
+    uint64_t ring_head = 0;
+    int event_fd = -1;
+    bool ring_dirty = false;
+    std::deque<std::string> queue;
+    uint64_t dropped = 0;
+};
+
+static void ring_push(struct subscriber *s, const struct uevent *ev) {
+    struct uevent_ring *ring = s->ring;
+    uint64_t n = s->ring_head++;
+    struct uevent_ring_slot *slot = &ring->slot[n % s->ring_slots];
+    slot->seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->ts_ns = ev->ts_ns;
+    slot->len = ev->len;
+    memcpy(slot->data, ev->buf, ev->len + 1);
+    slot->seq.store(2 * n + 2, std::memory_order_release);
+    ring->head.store(s->ring_head, std::memory_order_release);
+}
+
+int uevent_ring_pop(struct uevent_ring *ring, uint64_t *tail, char *buf, struct uevent *ev, uint64_t *dropped) {
+    while(1) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        if(*tail == head) return 0;
+        if(head - *tail > ring->slots) {
+            *dropped += head - ring->slots - *tail;
+            *tail = head - ring->slots;
+        }
+        uint64_t n = (*tail)++;
+        struct uevent_ring_slot *slot = &ring->slot[n % ring->slots];
+        uint64_t seq = slot->seq.load(std::memory_order_acquire);
+        if(seq != 2 * n + 2) {
+            (*dropped)++;
+            continue;
+        }
+        uint32_t len = slot->len;
+        uint64_t ts = slot->ts_ns;
+        if(len > UEVENT_MSG_SIZE) len = UEVENT_MSG_SIZE;
+        memcpy(buf, slot->data, len);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(slot->seq.load(std::memory_order_relaxed) != seq) {
+            // Overwritten while we were copying
+            (*dropped)++;
+            continue;
+        }
+        buf[len] = 0;
+        if(!uevent_parse(ev, buf, len)) continue;
+        ev->ts_ns = ts;
+        return 1;
+    }
+}
+
+static int mux_epoll;
+
+static void send_fds(int sock, const char *msg, const int *fds, int n_fds) {
+    struct iovec iov = { (void*)msg, strlen(msg) };
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if(n_fds) {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+    }
+    sendmsg(sock, &mh, MSG_NOSIGNAL);
+}
+
+static void drop_subscriber(struct subscriber *s) {
+    epoll_ctl(mux_epoll, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    if(s->ring) munmap(s->ring, ring_size(s->ring_slots));
+    if(s->event_fd != -1) close(s->event_fd);
+    s->fd = -1;
+}
+
+static bool subscriber_register(struct subscriber *s, const char *msg, size_t len) {
+    size_t hello_len = strlen(MUX_HELLO) + 1;
+    if(len < hello_len || memcmp(msg, MUX_HELLO, hello_len) != 0) return false;
+    s->filters_text.assign(msg + hello_len, len - hello_len);
+    s->filters_text.push_back(0);
+
+    const char *p = s->filters_text.c_str();
+    const char *end = p + s->filters_text.size() - 1;
+    while(p < end) {
+        if(strncmp(p, "ring=", 5) == 0) {
+            s->ring_slots = atoi(p + 5);
+        } else if(*p && s->n_filters < UEVENT_MAX_FILTERS) {
+            uevent_filter_parse(&s->filters[s->n_filters++], p);
+        }
+        p += strlen(p) + 1;
+    }
+
+    if(s->ring_slots == 0) {
+        send_fds(s->fd, "OK", NULL, 0);
+        return true;
+    }
+    if(s->ring_slots > MUX_MAX_RING_SLOTS) s->ring_slots = MUX_MAX_RING_SLOTS;
+    size_t size = ring_size(s->ring_slots);
+    int mem_fd = syscall(__NR_memfd_create, "uevent-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(mem_fd == -1 || ftruncate(mem_fd, size) < 0 ||
+            fcntl(mem_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        if(mem_fd != -1) close(mem_fd);
+        return false;
+    }
+    // What the subscriber gets, it can't map that writable
+    char ro_path[64];
+    snprintf(ro_path, sizeof(ro_path), "/proc/self/fd/%d", mem_fd);
+    int ro_fd = open(ro_path, O_RDONLY | O_CLOEXEC);
+    if(ro_fd == -1) {
+        close(mem_fd);
+        return false;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    close(mem_fd);
+    if(map == MAP_FAILED) {
+        close(ro_fd);
+        return false;
+    }
+    s->ring = (struct uevent_ring*)map;
+    s->ring->slots = s->ring_slots;
+    s->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int fds[2] = { ro_fd, s->event_fd };
+    send_fds(s->fd, "OK", fds, 2);
+    close(ro_fd);
+    return true;
+}
+
+static void subscriber_flush(struct subscriber *s) {
+    while(!s->queue.empty()) {
+        const std::string& msg = s->queue.front();
+        if(send(s->fd, msg.data(), msg.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            if(errno != EAGAIN) drop_subscriber(s);
+            break;
+        }
+        s->queue.pop_front();
+    }
+    if(s->fd == -1) return;
+    struct epoll_event ee;
+    ee.events = EPOLLIN | (s->queue.empty() ? 0u : (uint32_t)EPOLLOUT);
+    ee.data.ptr = s;
+    epoll_ctl(mux_epoll, EPOLL_CTL_MOD, s->fd, &ee);
+}
+
+static void subscriber_deliver(struct subscriber *s, const struct uevent *ev) {
+    if(s->ring) {
+        ring_push(s, ev);
+        s->ring_dirty = true;
+        return;
+    }
+    if(s->queue.empty()) {
+        if(send(s->fd, ev->buf, ev->len, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) return;
+        if(errno != EAGAIN) {
+            drop_subscriber(s);
+            return;
+        }
+    }
+    if(s->queue.size() == MUX_QUEUE_MAX) {
+        s->queue.pop_front();
+        s->dropped++;
+    }
+    if(s->queue.empty()) {
+        // Wait for room in the socket
+        struct epoll_event ee;
+        ee.events = EPOLLIN | EPOLLOUT;
+        ee.data.ptr = s;
+        epoll_ctl(mux_epoll, EPOLL_CTL_MOD, s->fd, &ee);
+    }
+    s->queue.emplace_back(ev->buf, ev->len);
+}
+
+int uevent_mux_main(int argc, char **argv) {
+    const char *path = NULL;
+    bool verbose = false;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-v") == 0) verbose = true;
+        else path = argv[i];
+    }
+    if(!path) {
+        fprintf(stderr, "Usage: uevent mux [-v] <socket>\n");
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) return 1;
+    strcpy(addr.sun_path, path);
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    unlink(path);
+    if(listen_fd == -1 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0) {
+        perror("Couldn't listen on mux socket");
+        return 1;
+    }
+    chmod(path, 0666);
+
+    int nl_fd = uevent_open_netlink(0xffffffff);
+    if(nl_fd == -1) return 1;
+    fcntl(nl_fd, F_SETFL, fcntl(nl_fd, F_GETFL) | O_NONBLOCK);
+
+    signal(SIGPIPE, SIG_IGN);
+    mux_epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ee;
+    ee.events = EPOLLIN;
+    ee.data.ptr = &nl_fd;
+    epoll_ctl(mux_epoll, EPOLL_CTL_ADD, nl_fd, &ee);
+    ee.data.ptr = &listen_fd;
+    epoll_ctl(mux_epoll, EPOLL_CTL_ADD, listen_fd, &ee);
+
+    std::vector<struct subscriber*> subscribers;
+    char buffer[UEVENT_MSG_SIZE + 1];
+    while(1) {
+        struct epoll_event events[MUX_MAX_EVENTS];
+        int n = epoll_wait(mux_epoll, events, MUX_MAX_EVENTS, -1);
+        if(n < 0 && errno != EINTR) return 1;
+        for(int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if(ptr == &listen_fd) {
+                int fd;
+                while((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+                    struct subscriber *s = new subscriber;
+                    s->fd = fd;
+                    ee.events = EPOLLIN;
+                    ee.data.ptr = s;
+                    epoll_ctl(mux_epoll, EPOLL_CTL_ADD, fd, &ee);
+                    subscribers.push_back(s);
+                }
+            } else if(ptr == &nl_fd) {
+                // Drain everything pending, parse each event once for all
+                struct uevent ev;
+                while(1) {
+                    ssize_t len = recv(nl_fd, buffer, UEVENT_MSG_SIZE, MSG_DONTWAIT);
+                    if(len < 0) {
+                        if(errno == ENOBUFS) continue;
+                        break;
+                    }
+                    buffer[len] = 0;
+                    ev.ts_ns = uevent_now_ns();
+                    if(!uevent_parse(&ev, buffer, len)) continue;
+                    for(auto s: subscribers) {
+                        if(s->fd == -1 || !s->registered) continue;
+                        if(!uevent_match(s->filters, s->n_filters, &ev)) continue;
+                        subscriber_deliver(s, &ev);
+                    }
+                }
+                for(auto s: subscribers) {
+                    if(s->fd == -1 || !s->ring_dirty) continue;
+                    uint64_t one = 1;
+                    write(s->event_fd, &one, sizeof(one));
+                    s->ring_dirty = false;
+                }
+            } else {
+                struct subscriber *s = (struct subscriber*)ptr;
+                if(s->fd == -1) continue;
+                if(events[i].events & EPOLLOUT)
+                    subscriber_flush(s);
+                if(s->fd != -1 && (events[i].events & EPOLLIN)) {
+                    ssize_t len = recv(s->fd, buffer, UEVENT_MSG_SIZE, MSG_DONTWAIT);
+                    if(len > 0 && !s->registered) {
+                        s->registered = subscriber_register(s, buffer, len);
+                        if(!s->registered) drop_subscriber(s);
+                        else if(verbose)
+                            fprintf(stderr, "Subscriber %d: %d filters, %u ring slots\n", s->fd, s->n_filters, s->ring_slots);
+                    } else if(len == 0 || (len < 0 && errno != EAGAIN)) {
+                        if(verbose)
+                            fprintf(stderr, "Subscriber %d left, %llu events dropped\n", s->fd, (unsigned long long)s->dropped);
+                        drop_subscriber(s);
+                    }
+                }
+            }
+        }
+
+        // Dropped subscribers are only freed here, events may still point to them
+        for(size_t i = 0; i < subscribers.size(); ) {
+            if(subscribers[i]->fd == -1) {
+                delete subscribers[i];
+                subscribers[i] = subscribers.back();
+                subscribers.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+}
+
+int uevent_mux_connect(const char *path, char *const *filters, int n_filters, uint32_t ring_slots,
+        struct uevent_ring **ring, int *event_fd) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Couldn't connect to uevent mux");
+        if(fd != -1) close(fd);
+        return -1;
+    }
+
+    std::string hello(MUX_HELLO, strlen(MUX_HELLO) + 1);
+    if(ring_slots) {
+        hello += "ring=" + std::to_string(ring_slots);
+        hello.push_back(0);
+    }
+    for(int i = 0; i < n_filters; i++) {
+        hello += filters[i];
+        hello.push_back(0);
+    }
+    send(fd, hello.data(), hello.size(), MSG_NOSIGNAL);
+
+    char reply[16];
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { reply, sizeof(reply) };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    ssize_t len = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+    if(len < 2 || memcmp(reply, "OK", 2) != 0) {
+        fprintf(stderr, "uevent mux refused subscription\n");
+        close(fd);
+        return -1;
+    }
+    if(!ring_slots) return fd;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    if(!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        close(fd);
+        return -1;
+    }
+    int fds[2];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    struct stat st;
+    void *map = MAP_FAILED;
+    if(fstat(fds[0], &st) == 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if(map != MAP_FAILED && (size_t)st.st_size < ring_size(((struct uevent_ring*)map)->slots)) {
+        munmap(map, st.st_size);
+        map = MAP_FAILED;
+    }
+    if(map == MAP_FAILED) {
+        close(fds[1]);
+        close(fd);
+        return -1;
+    }
+    *ring = (struct uevent_ring*)map;
+    *event_fd = fds[1];
+    return fd;
+}
@@ -0,0 +1,268 @@
+#include "uevent.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <linux/sockios.h>
+
+/*
+ * Log format: UEVENT_LOG_MAGIC, then for every message a record header
+ * followed by the raw netlink payload. Native endianness, it is meant to be
+ * replayed on the machine that recorded it or one like it.
+ */
+#define UEVENT_LOG_MAGIC "UEVLOG1\n"
+
+struct uevent_log_record {
+    uint64_t ts_ns; // CLOCK_MONOTONIC at reception
+    uint32_t len;
+} __attribute__((packed));
+
+static int log_fd = -1;
+static int n_recorded;
+
+static void record(const struct uevent *ev) {
+    struct uevent_log_record hdr = { ev->ts_ns, (uint32_t)ev->len };
+    struct iovec iov[2] = {
+        { &hdr, sizeof(hdr) },
+        { (void*)ev->buf, ev->len },
+    };
+    if(writev(log_fd, iov, 2) < 0) {
+        perror("Failed writing log");
+        exit(1);
+    }
+    n_recorded++;
+}
+
+static void trigger_add(const struct uevent *ev, void *) {
+    const char *devpath = uevent_get(ev, "DEVPATH");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys%s/uevent", devpath);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if(fd == -1) return;
+    write(fd, "add", 3);
+    close(fd);
+}
+
+static void report_recorded(int) {
+    fprintf(stderr, "Recorded %d events\n", n_recorded);
+    _exit(0);
+}
+
+int uevent_record_main(int argc, char **argv) {
+    bool trigger = false;
+    const char *file = NULL;
+    struct uevent_filter filters[UEVENT_MAX_FILTERS];
+    int n_filters = 0;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-t") == 0) trigger = true;
+        else if(!file) file = argv[i];
+        else if(n_filters < UEVENT_MAX_FILTERS) uevent_filter_parse(&filters[n_filters++], argv[i]);
+    }
+    if(!file) {
+        fprintf(stderr, "Usage: uevent record [-t] <log> [filter...]\n");
+        fprintf(stderr, "\t-t\tmake the kernel resend \"add\" for every device, to capture a coldplug storm\n");
+        return 1;
+    }
+
+    log_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(log_fd == -1) {
+        perror("Couldn't open log");
+        return 1;
+    }
+    write(log_fd, UEVENT_LOG_MAGIC, strlen(UEVENT_LOG_MAGIC));
+
+    int fd = uevent_open_netlink(0xffffffff);
+    if(fd == -1) return 1;
+
+    signal(SIGINT, report_recorded);
+    signal(SIGTERM, report_recorded);
+
+    if(trigger) {
+        // Runs before we start reading, the socket buffer absorbs the storm
+        int n = uevent_coldplug("/sys/devices", trigger_add, NULL);
+        fprintf(stderr, "Triggered %d devices\n", n);
+    }
+
+    char buffer[UEVENT_MSG_SIZE + 1];
+    struct uevent ev;
+    while(1) {
+        int r = uevent_recv(fd, buffer, &ev);
+        if(r < 0) return 1;
+        if(r == 0) continue;
+        if(!uevent_match(filters, n_filters, &ev)) continue;
+        record(&ev);
+    }
+}
+
+enum replay_output { REPLAY_SOCKET, REPLAY_TEXT, REPLAY_JSON };
+
+static uint64_t ns_from_double(double v) {
+    return v < 0 ? 0 : (uint64_t)v;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000ULL;
+    ts.tv_nsec = deadline_ns % 1000000000ULL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// Bytes written to out but not read yet by the consumer
+static int pending_bytes(int fd, enum replay_output output) {
+    int n = 0;
+    if(ioctl(fd, output == REPLAY_SOCKET ? SIOCOUTQ : FIONREAD, &n) < 0) return 0;
+    return n;
+}
+
+int uevent_replay_main(int argc, char **argv) {
+    double speed = 1.0;
+    bool flat_out = false;
+    const char *socket_path = NULL;
+    enum replay_output output = REPLAY_JSON;
+    const char *file = NULL;
+    char **consumer = NULL;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) speed = atof(argv[++i]);
+        else if(strcmp(argv[i], "-f") == 0) flat_out = true;
+        else if(strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+            output = REPLAY_SOCKET;
+        }
+        else if(strcmp(argv[i], "-t") == 0) output = REPLAY_TEXT;
+        else if(strcmp(argv[i], "--") == 0) {
+            consumer = argv + i + 1;
+            break;
+        }
+        else file = argv[i];
+    }
+    if(!file || speed <= 0 || (socket_path && consumer)) {
+        fprintf(stderr, "Usage: uevent replay [-s speed | -f] [-u socket | -t] <log> [-- consumer args...]\n");
+        fprintf(stderr, "\t-s\treplay N times faster than recorded (default 1)\n");
+        fprintf(stderr, "\t-f\treplay as fast as the consumer takes it\n");
+        fprintf(stderr, "\t-u\tsend raw messages to the stand-in socket of a consumer\n");
+        fprintf(stderr, "\t\tstarted with UEVENT_SOCKET=<socket>\n");
+        fprintf(stderr, "\t-t\tfeed text like \"uevent\" prints, instead of NDJSON\n");
+        fprintf(stderr, "Without -u, events go to the consumer's stdin, or to our stdout\n");
+        return 1;
+    }
+
+    int in = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(in == -1 || fstat(in, &st) < 0) {
+        perror("Couldn't open log");
+        return 1;
+    }
+    size_t size = st.st_size;
+    const char *data = size ? (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, in, 0) : NULL;
+    size_t magic_len = strlen(UEVENT_LOG_MAGIC);
+    if(data == MAP_FAILED || size < magic_len || memcmp(data, UEVENT_LOG_MAGIC, magic_len) != 0) {
+        fprintf(stderr, "%s is not a uevent log\n", file);
+        return 1;
+    }
+
+    int out = STDOUT_FILENO;
+    pid_t child = -1;
+    if(socket_path) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+        out = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if(out == -1 || connect(out, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("Couldn't connect to stand-in socket");
+            return 1;
+        }
+    } else if(consumer) {
+        int p[2];
+        if(pipe2(p, O_CLOEXEC) < 0) return 1;
+        child = fork();
+        if(child == 0) {
+            dup2(p[0], STDIN_FILENO);
+            execvp(consumer[0], consumer);
+            _exit(127);
+        }
+        close(p[0]);
+        out = p[1];
+    }
+    signal(SIGPIPE, SIG_IGN);
+    FILE *fout = output == REPLAY_SOCKET ? NULL : fdopen(out, "w");
+
+    // Copy every message, the parser wants it NUL-terminated
+    char buffer[UEVENT_MSG_SIZE + 1];
+    uint64_t first_ts = 0;
+    uint64_t start = uevent_now_ns();
+    uint64_t max_late = 0, total_late = 0;
+    int max_pending = 0;
+    int n = 0;
+    size_t bytes = 0;
+    for(size_t off = magic_len; off + sizeof(struct uevent_log_record) <= size; ) {
+        struct uevent_log_record hdr;
+        memcpy(&hdr, data + off, sizeof(hdr));
+        off += sizeof(hdr);
+        if(hdr.len > UEVENT_MSG_SIZE || off + hdr.len > size) {
+            fprintf(stderr, "Truncated log at offset %zu\n", off);
+            break;
+        }
+        memcpy(buffer, data + off, hdr.len);
+        buffer[hdr.len] = 0;
+        off += hdr.len;
+
+        if(n == 0) first_ts = hdr.ts_ns;
+        uint64_t deadline = start + ns_from_double((hdr.ts_ns - first_ts) / speed);
+        if(!flat_out) sleep_until(deadline);
+
+        bool ok;
+        if(output == REPLAY_SOCKET) {
+            ok = send(out, buffer, hdr.len, 0) >= 0;
+        } else {
+            struct uevent ev;
+            if(!uevent_parse(&ev, buffer, hdr.len)) continue;
+            ev.ts_ns = hdr.ts_ns;
+            if(output == REPLAY_JSON)
+                uevent_print_json(&ev, fout);
+            else
+                uevent_print_text(&ev, fout);
+            ok = fflush(fout) == 0;
+        }
+        if(!ok) {
+            perror("Consumer went away");
+            break;
+        }
+
+        // How far behind schedule the consumer pushed us
+        uint64_t now = uevent_now_ns();
+        uint64_t late = (!flat_out && now > deadline) ? now - deadline : 0;
+        total_late += late;
+        if(late > max_late) max_late = late;
+        int pending = pending_bytes(out, output);
+        if(pending > max_pending) max_pending = pending;
+        n++;
+        bytes += hdr.len;
+    }
+    uint64_t sent = uevent_now_ns();
+
+    // Wait for the consumer to drain what we sent
+    if(out != STDOUT_FILENO) {
+        while(pending_bytes(out, output) > 0 && uevent_now_ns() - sent < 10000000000ULL)
+            poll(NULL, 0, 1);
+    }
+    uint64_t drained = uevent_now_ns();
+    if(fout) fclose(fout);
+    else close(out);
+    if(child > 0) waitpid(child, NULL, 0);
+    uint64_t done = uevent_now_ns();
+
+    fprintf(stderr, "Replayed %d events, %zu bytes in %.3f ms\n", n, bytes, (sent - start) / 1e6);
+    if(!flat_out && n > 0)
+        fprintf(stderr, "Send lateness: avg %.3f ms, max %.3f ms\n", total_late / 1e6 / n, max_late / 1e6);
+    fprintf(stderr, "Consumer backlog: max %d bytes, drained %.3f ms after last event\n",
+            max_pending, (drained - sent) / 1e6);
+    if(child > 0)
+        fprintf(stderr, "Consumer exited %.3f ms after last event\n", (done - sent) / 1e6);
+    return 0;
+}
@@ -1,62 +1,108 @@
-typedef unsigned short int sa_family_t;
-#define __KERNEL_STRICT_NAMES
-#include <sys/types.h>
-#include <linux/netlink.h>
-#include <sys/socket.h> 
-#include <string.h>
+#include "uevent.h"
+#include <poll.h>
 #include <stdlib.h>
-#include <stdio.h>
-#include <unistd.h>
 
-//From a uevent patch for hal
-#define HOTPLUG_BUFFER_SIZE             1024
-#define HOTPLUG_NUM_ENVP                32
-#define OBJECT_SIZE                     512
+static void usage(const char *argv0) {
+        fprintf(stderr, "Usage: %s [-j] [-m socket [-r slots]] [filter...]\n", argv0);
+        fprintf(stderr, "       %s coldplug [-j] [-q] [-p threads] [-i subtree]... [-x subtree]... [filter...]\n", argv0);
+        fprintf(stderr, "       %s daemon [-n] [-v] <rules>\n", argv0);
+        fprintf(stderr, "       %s record [-t] <log> [filter...]\n", argv0);
+        fprintf(stderr, "       %s replay [-s speed | -f] [-u socket | -t] <log> [-- consumer args...]\n", argv0);
+        fprintf(stderr, "       %s mux [-v] <socket>\n", argv0);
+        fprintf(stderr, "\t-j\tprint events as NDJSON, with monotonic timestamps\n");
+        fprintf(stderr, "\t-m\tsubscribe to a uevent mux instead of opening netlink\n");
+        fprintf(stderr, "\t-r\tget events from the mux through a shared ring of that many slots\n");
+        fprintf(stderr, "\tfilter\tKEY=glob, KEY!=glob, or a substring of ACTION@DEVPATH\n");
+        fprintf(stderr, "\t\tAll filters must match\n");
+        fprintf(stderr, "Set UEVENT_SOCKET=<path> to read from a replay stand-in instead of netlink\n");
+}
 
-#ifndef NETLINK_KOBJECT_UEVENT
-#error Your kernel headers are too old, and do not define NETLINK_KOBJECT_UEVENT. You need Linux 2.6.10 or higher for KOBJECT_UEVENT support.
-#endif
+int main(int argc, char **argv) {
+        if(argc >= 2 && strcmp(argv[1], "coldplug") == 0)
+            return uevent_coldplug_main(argc - 1, argv + 1);
+        if(argc >= 2 && strcmp(argv[1], "daemon") == 0)
+            return uevent_daemon_main(argc - 1, argv + 1);
+        if(argc >= 2 && strcmp(argv[1], "record") == 0)
+            return uevent_record_main(argc - 1, argv + 1);
+        if(argc >= 2 && strcmp(argv[1], "replay") == 0)
+            return uevent_replay_main(argc - 1, argv + 1);
+        if(argc >= 2 && strcmp(argv[1], "mux") == 0)
+            return uevent_mux_main(argc - 1, argv + 1);
 
-int main(int argc, char **argv, char **envp) {
-        //Start listening
-        int fd;
-        struct sockaddr_nl ksnl;
-        memset(&ksnl, 0x00, sizeof(struct sockaddr_nl));
-        ksnl.nl_family=AF_NETLINK;
-        ksnl.nl_pid=getpid();
-        ksnl.nl_groups=0xffffffff;
-        fd=socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
-        if (fd==-1) {
-                printf("Couldn't open kobject-uevent netlink socket");
-                perror("");
+        bool json = false;
+        const char *mux = NULL;
+        uint32_t ring_slots = 0;
+        struct uevent_filter filters[UEVENT_MAX_FILTERS];
+        char *filter_args[UEVENT_MAX_FILTERS];
+        int n_filters = 0;
+
+        for(int i = 1; i < argc; i++) {
+            if(strcmp(argv[i], "-j") == 0) {
+                json = true;
+            } else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+                mux = argv[++i];
+            } else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+                ring_slots = atoi(argv[++i]);
+            } else if(strcmp(argv[i], "-h") == 0 || n_filters == UEVENT_MAX_FILTERS) {
+                usage(argv[0]);
                 exit(1);
+            } else {
+                filter_args[n_filters] = argv[i];
+                uevent_filter_parse(&filters[n_filters++], argv[i]);
+            }
         }
-        if (bind(fd, (struct sockaddr *) &ksnl, sizeof(struct sockaddr_nl))<0) {
-                fprintf (stderr, "Error binding to netlink socket");
-                close(fd);
+
+        //Start listening
+        struct uevent_ring *ring = NULL;
+        int event_fd = -1;
+        int fd;
+        if(mux)
+            fd = uevent_mux_connect(mux, filter_args, n_filters, ring_slots, &ring, &event_fd);
+        else
+            fd = uevent_open_netlink(0xffffffff);
+        if (fd == -1) {
                 exit(1);
         }
 
+        char buffer[UEVENT_MSG_SIZE + 1];
+        struct uevent ev;
+        uint64_t tail = 0, dropped = 0;
+        bool mux_gone = false;
         while(1) {
-                char buffer[HOTPLUG_BUFFER_SIZE + OBJECT_SIZE];
-                int buflen;
-                buflen=recv(fd, &buffer, sizeof(buffer), 0);
-                if (buflen<0) {
-                        exit(1);
+                int r;
+                if(ring) {
+                    uint64_t prev_dropped = dropped;
+                    r = uevent_ring_pop(ring, &tail, buffer, &ev, &dropped);
+                    if(dropped != prev_dropped)
+                        fprintf(stderr, "Lagging behind, %llu events dropped so far\n", (unsigned long long)dropped);
+                    if(r == 0) {
+                        if(mux_gone) {
+                            fprintf(stderr, "uevent mux went away\n");
+                            exit(1);
+                        }
+                        struct pollfd pfd[2] = { { event_fd, POLLIN, 0 }, { fd, POLLIN, 0 } };
+                        uint64_t count;
+                        if(poll(pfd, 2, -1) < 0 && errno != EINTR) exit(1);
+                        if(pfd[0].revents & POLLIN)
+                            read(event_fd, &count, sizeof(count));
+                        // Nothing is sent on the socket once the ring is set up, so it
+                        // can only have been closed. What is left in the ring goes first
+                        if(pfd[1].revents) mux_gone = true;
+                        continue;
+                    }
+                } else {
+                    r = uevent_recv(fd, buffer, &ev);
                 }
-
-                if(argc>=2) {
-                    if(!strstr(buffer, argv[1])) continue;
+                if (r < 0) {
+                        exit(1);
                 }
+                if (r == 0) continue;
+                if(!uevent_match(filters, n_filters, &ev)) continue;
 
-                printf("%s\n", buffer);
-                char *pos = buffer + strlen(buffer);
-                char *end = buffer + buflen;
-                while(pos < end) {
-                    int l = strlen(pos);
-                    printf("\t%s\n", pos);
-                    pos += l+1;
-                }
+                if(json)
+                    uevent_print_json(&ev, stdout);
+                else
+                    uevent_print_text(&ev, stdout);
+                fflush(stdout);
         }
-
 }
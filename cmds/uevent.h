@@ -0,0 +1,288 @@
+#pragma once
+
+typedef unsigned short int sa_family_t;
+#define __KERNEL_STRICT_NAMES
+#include <sys/types.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef NETLINK_KOBJECT_UEVENT
+#error Your kernel headers are too old, and do not define NETLINK_KOBJECT_UEVENT. You need Linux 2.6.10 or higher for KOBJECT_UEVENT support.
+#endif
+
+// Kernel builds messages in a UEVENT_BUFFER_SIZE (2048) buffer, plus the
+// ACTION@DEVPATH header in front of it
+#define UEVENT_MSG_SIZE                 (2048 + 512)
+#define UEVENT_MAX_ENV                  64
+#define UEVENT_MAX_FILTERS              16
+
+// A view over one received message. Nothing is copied: header, keys and
+// values all point into the receive buffer, which must outlive the view
+// and be NUL-terminated at buf[len].
+struct uevent_kv {
+    const char *key;
+    size_t key_len;
+    const char *value; // NUL-terminated, it is the end of the kernel string
+};
+
+struct uevent {
+    uint64_t ts_ns; // CLOCK_MONOTONIC at reception
+    const char *buf;
+    size_t len;
+    const char *header; // "ACTION@DEVPATH"
+    int n_env;
+    int dropped_env; // key=value pairs beyond UEVENT_MAX_ENV
+    struct uevent_kv env[UEVENT_MAX_ENV];
+};
+
+// "KEY=glob", "KEY!=glob", or a bare string which is looked for in the
+// header, like uevent always did
+struct uevent_filter {
+    const char *key;
+    size_t key_len;
+    const char *pattern;
+    bool negate;
+};
+
+static inline uint64_t uevent_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline bool uevent_parse(struct uevent *ev, const char *buf, size_t len) {
+    ev->buf = buf;
+    ev->len = len;
+    ev->header = buf;
+    ev->n_env = 0;
+    ev->dropped_env = 0;
+    // Ignore udevd re-broadcasts, they are binary
+    if(len < 1 || strncmp(buf, "libudev", 7) == 0) return false;
+    if(!strchr(buf, '@')) return false;
+
+    const char *end = buf + len;
+    const char *pos = buf + strlen(buf) + 1;
+    while(pos < end) {
+        size_t l = strlen(pos);
+        const char *eq = (const char*)memchr(pos, '=', l);
+        if(eq) {
+            if(ev->n_env < UEVENT_MAX_ENV) {
+                struct uevent_kv *kv = &ev->env[ev->n_env++];
+                kv->key = pos;
+                kv->key_len = eq - pos;
+                kv->value = eq + 1;
+            } else {
+                ev->dropped_env++;
+            }
+        }
+        pos += l + 1;
+    }
+    return true;
+}
+
+static inline const char *uevent_get(const struct uevent *ev, const char *key, size_t key_len) {
+    for(int i = 0; i < ev->n_env; i++) {
+        const struct uevent_kv *kv = &ev->env[i];
+        if(kv->key_len == key_len && memcmp(kv->key, key, key_len) == 0)
+            return kv->value;
+    }
+    return NULL;
+}
+
+static inline const char *uevent_get(const struct uevent *ev, const char *key) {
+    return uevent_get(ev, key, strlen(key));
+}
+
+// Points into arg, which must outlive the filter
+static inline void uevent_filter_parse(struct uevent_filter *f, const char *arg) {
+    const char *eq = strchr(arg, '=');
+    f->key = NULL;
+    f->key_len = 0;
+    f->pattern = arg;
+    f->negate = false;
+    if(!eq || eq == arg) return;
+    f->key = arg;
+    f->key_len = eq - arg;
+    f->pattern = eq + 1;
+    if(eq[-1] == '!') {
+        f->negate = true;
+        f->key_len--;
+    }
+}
+
+static inline bool uevent_filter_match(const struct uevent_filter *f, const struct uevent *ev) {
+    if(!f->key)
+        return strstr(ev->header, f->pattern) != NULL;
+    const char *v = uevent_get(ev, f->key, f->key_len);
+    bool m = v && fnmatch(f->pattern, v, 0) == 0;
+    return m != f->negate;
+}
+
+static inline bool uevent_match(const struct uevent_filter *filters, int n, const struct uevent *ev) {
+    for(int i = 0; i < n; i++)
+        if(!uevent_filter_match(&filters[i], ev)) return false;
+    return true;
+}
+
+static inline void uevent_print_text(const struct uevent *ev, FILE *out) {
+    fprintf(out, "%s\n", ev->header);
+    const char *end = ev->buf + ev->len;
+    const char *pos = ev->header + strlen(ev->header) + 1;
+    while(pos < end) {
+        size_t l = strlen(pos);
+        fprintf(out, "\t%s\n", pos);
+        pos += l + 1;
+    }
+}
+
+static inline void uevent_json_string(const char *s, size_t len, FILE *out) {
+    putc_unlocked('"', out);
+    for(size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if(c == '"' || c == '\\') {
+            putc_unlocked('\\', out);
+            putc_unlocked(c, out);
+        } else if(c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            putc_unlocked(c, out);
+        }
+    }
+    putc_unlocked('"', out);
+}
+
+// One line per event (NDJSON)
+static inline void uevent_print_json(const struct uevent *ev, FILE *out) {
+    fprintf(out, "{\"ts_ns\":%llu,\"header\":", (unsigned long long)ev->ts_ns);
+    uevent_json_string(ev->header, strlen(ev->header), out);
+    for(int i = 0; i < ev->n_env; i++) {
+        const struct uevent_kv *kv = &ev->env[i];
+        putc_unlocked(',', out);
+        uevent_json_string(kv->key, kv->key_len, out);
+        putc_unlocked(':', out);
+        uevent_json_string(kv->value, strlen(kv->value), out);
+    }
+    if(ev->dropped_env)
+        fprintf(out, ",\"_dropped\":%d", ev->dropped_env);
+    fputs("}\n", out);
+}
+
+// Benchmark stand-in for the netlink socket: an AF_UNIX datagram socket,
+// with one raw uevent message per datagram. See "uevent replay -u".
+static inline int uevent_open_standin(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        perror("Couldn't open stand-in socket");
+        return -1;
+    }
+    unlink(path);
+    if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("Error binding to stand-in socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline int uevent_open_netlink(unsigned groups) {
+    const char *standin = getenv("UEVENT_SOCKET");
+    if(standin) return uevent_open_standin(standin);
+
+    struct sockaddr_nl ksnl;
+    memset(&ksnl, 0x00, sizeof(struct sockaddr_nl));
+    ksnl.nl_family = AF_NETLINK;
+    ksnl.nl_pid = 0;
+    ksnl.nl_groups = groups;
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if(fd == -1) {
+        perror("Couldn't open kobject-uevent netlink socket");
+        return -1;
+    }
+    // Coldplug storms easily overflow the default receive buffer
+    int bufsz = 2 * 1024 * 1024;
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bufsz, sizeof(bufsz)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+    if(bind(fd, (struct sockaddr *) &ksnl, sizeof(struct sockaddr_nl)) < 0) {
+        perror("Error binding to netlink socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Receives one message into buf (of size UEVENT_MSG_SIZE + 1) and parses it.
+// Returns -1 on fatal error, 0 if the message should be skipped, 1 otherwise.
+static inline int uevent_recv(int fd, char *buf, struct uevent *ev) {
+    ssize_t buflen = recv(fd, buf, UEVENT_MSG_SIZE, 0);
+    if(buflen < 0) {
+        // ENOBUFS means we lost events, but we can keep going
+        if(errno == EINTR || errno == ENOBUFS || errno == EAGAIN) return 0;
+        return -1;
+    }
+    buf[buflen] = 0;
+    ev->ts_ns = uevent_now_ns();
+    return uevent_parse(ev, buf, buflen) ? 1 : 0;
+}
+
+typedef void (*uevent_cb)(const struct uevent *ev, void *cookie);
+
+// Builds a synthetic "add" message for /sys<devpath> from its uevent file,
+// the way the kernel would have sent it. Returns 0 if there is no such
+// device.
+size_t uevent_synthesize(char *buf, size_t size, const char *devpath);
+
+struct uevent_coldplug_opts {
+    const char *const *include; // subtrees to walk, /sys/devices if none
+    int n_include;
+    const char *const *exclude; // subtrees to skip
+    int n_exclude;
+    int threads; // 0 for one per CPU
+};
+
+struct uevent_coldplug_stats {
+    int dirs;
+    int events;
+    int steals;
+    int threads;
+    uint64_t elapsed_ns;
+};
+
+// Calls cb with a synthetic "add" event for every device below the included
+// subtrees. The walk runs on a pool of threads, but calls to cb are
+// serialized. Returns the number of events emitted.
+int uevent_coldplug(const struct uevent_coldplug_opts *opts, uevent_cb cb, void *cookie,
+        struct uevent_coldplug_stats *stats);
+int uevent_coldplug(const char *root, uevent_cb cb, void *cookie);
+
+int uevent_coldplug_main(int argc, char **argv);
+int uevent_daemon_main(int argc, char **argv);
+int uevent_record_main(int argc, char **argv);
+int uevent_mux_main(int argc, char **argv);
+int uevent_replay_main(int argc, char **argv);
+
+// Subscribes to "uevent mux" listening on path. Returns the subscription
+// socket, which then receives one raw message per packet. With ring_slots,
+// events come through the shared *ring instead, and *event_fd becomes
+// readable whenever new ones are there.
+struct uevent_ring;
+int uevent_mux_connect(const char *path, char *const *filters, int n_filters, uint32_t ring_slots,
+        struct uevent_ring **ring, int *event_fd);
+
+// Takes the next event from the ring, copying it to buf (of size
+// UEVENT_MSG_SIZE + 1). Returns 0 when the ring is empty. Events the
+// producer overwrote before we got to them are added to *dropped.
+int uevent_ring_pop(struct uevent_ring *ring, uint64_t *tail, char *buf, struct uevent *ev, uint64_t *dropped);
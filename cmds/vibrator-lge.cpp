@@ -1,11 +1,245 @@
 #include <iostream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 #include <vendor/lge/hardware/vibrator/1.0/IVibratorEx.h>
 
 using ::vendor::lge::hardware::vibrator::V1_0::IVibratorEx;
+using ::android::hardware::hidl_vec;
+using ::android::hardware::Return;
+using ::android::hardware::vibrator::V1_0::Status;
 using ::android::sp;
 
+/*
+ * seq plays a waveform over one IVibratorEx connection. Steps are
+ * scheduled on a timerfd at absolute deadlines from the start, so a late
+ * step doesn't push the ones after it. A step is one of
+ *   MS:AMP                            vibrate at AMP (1-255), or pause if 0
+ *   MS:perform:EFFECT:STRENGTH        the effect's own length if MS is 0
+ *   MS:fx:INDEX:STRENGTH:HEXDATA      vendor effect data
+ * and "-" reads them from stdin. Each step reports how late it started
+ * and how long the HAL took, the summary goes to stdout.
+ */
+
+enum step_kind {
+	STEP_AMPLITUDE,
+	STEP_PERFORM,
+	STEP_EFFECT_DATA,
+};
+
+struct step {
+	step_kind kind;
+	int ms;
+	int amplitude;
+	int effect;
+	int strength;
+	std::vector<uint8_t> data;
+};
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool parse_step(const std::string& s, struct step *out) {
+	std::vector<std::string> f;
+	size_t pos = 0;
+	while(true) {
+		size_t colon = s.find(':', pos);
+		f.push_back(s.substr(pos, colon == std::string::npos ? std::string::npos : colon - pos));
+		if(colon == std::string::npos) break;
+		pos = colon + 1;
+	}
+	char *end;
+	out->ms = strtol(f[0].c_str(), &end, 10);
+	if(f[0].empty() || *end != 0 || out->ms < 0 || f.size() < 2) return false;
+
+	if(f[1] == "perform" && f.size() == 4) {
+		out->kind = STEP_PERFORM;
+		out->effect = atoi(f[2].c_str());
+		out->strength = atoi(f[3].c_str());
+		return true;
+	}
+	if(f[1] == "fx" && f.size() == 5) {
+		out->kind = STEP_EFFECT_DATA;
+		out->effect = atoi(f[2].c_str());
+		out->strength = atoi(f[3].c_str());
+		const std::string& hex = f[4];
+		if(hex.size() % 2) return false;
+		for(size_t i = 0; i < hex.size(); i += 2) {
+			out->data.push_back((uint8_t)strtol(hex.substr(i, 2).c_str(), &end, 16));
+			if(*end != 0) return false;
+		}
+		return true;
+	}
+	if(f.size() != 2) return false;
+	out->kind = STEP_AMPLITUDE;
+	out->amplitude = strtol(f[1].c_str(), &end, 10);
+	return *end == 0 && out->amplitude >= 0 && out->amplitude <= 255;
+}
+
+// How long the motor stays on from step i, including the next repetitions
+static int run_ms(const std::vector<struct step>& steps, size_t i, int reps_left) {
+	int64_t ms = 0;
+	for(size_t n = i; n < steps.size() * ((size_t)reps_left + 1); n++) {
+		const struct step& s = steps[n % steps.size()];
+		if(s.kind != STEP_AMPLITUDE || s.amplitude == 0) break;
+		ms += s.ms;
+		// A steady waveform repeated long enough, off() ends it anyway
+		if(ms >= INT_MAX) return INT_MAX;
+	}
+	return ms;
+}
+
+// The call went through and the HAL did it. playEffectWithStrength returns a plain int
+template<typename T>
+static bool hal_ok(const Return<T>& ret) {
+	return ret.isOk() && (int)(T)ret == (int)Status::OK;
+}
+
+static bool wait_until(int fd, uint64_t deadline) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000000000ULL;
+	its.it_value.tv_nsec = deadline % 1000000000ULL;
+	if(timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) return false;
+	uint64_t expirations;
+	while(read(fd, &expirations, sizeof(expirations)) < 0) {
+		if(errno != EINTR) return false;
+	}
+	return true;
+}
+
+static void print_stats(const char *name, std::vector<uint64_t> v) {
+	if(v.empty()) return;
+	std::sort(v.begin(), v.end());
+	uint64_t sum = 0;
+	for(auto x: v) sum += x;
+	auto pct = [&v](double p) { return v[std::min(v.size() - 1, (size_t)(p * v.size()))] / 1000; };
+	printf("%s: n=%zu avg=%lluus p50=%lluus p99=%lluus max=%lluus\n", name, v.size(),
+			(unsigned long long)(sum / v.size() / 1000), (unsigned long long)pct(.5),
+			(unsigned long long)pct(.99), (unsigned long long)(v.back() / 1000));
+}
+
+static int sequence(sp<IVibratorEx> svc, int argc, char **argv) {
+	int repeat = 1;
+	bool verbose = false;
+	std::vector<std::string> args;
+	for(int i = 0; i < argc; i++) {
+		if(strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			repeat = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-v") == 0) {
+			verbose = true;
+		} else if(strcmp(argv[i], "-") == 0) {
+			std::string s;
+			while(std::cin >> s) args.push_back(s);
+		} else {
+			args.push_back(argv[i]);
+		}
+	}
+	std::vector<struct step> steps;
+	for(const auto& arg: args) {
+		struct step s;
+		if(!parse_step(arg, &s)) {
+			std::cerr << "Bad step " << arg << std::endl;
+			return 1;
+		}
+		steps.push_back(s);
+	}
+	if(steps.empty() || repeat < 1) {
+		std::cerr << "Usage: vibrator-lge seq [-r repeat] [-v] MS:AMP|MS:perform:EFFECT:STRENGTH|MS:fx:INDEX:STRENGTH:HEX... | -" << std::endl;
+		return 1;
+	}
+
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if(fd == -1) {
+		perror("timerfd_create");
+		return 1;
+	}
+
+	std::vector<uint64_t> late, call;
+	bool motor_on = false;
+	int amplitude = -1;
+	int failures = 0;
+	uint64_t start = now_ns();
+	uint64_t deadline = start;
+	for(int rep = 0; rep < repeat; rep++) {
+		for(size_t i = 0; i < steps.size(); i++) {
+			const struct step& s = steps[i];
+			if(!wait_until(fd, deadline)) return 1;
+			uint64_t t0 = now_ns();
+			uint64_t ms = s.ms;
+			bool ok = true;
+			if(s.kind == STEP_AMPLITUDE && s.amplitude == 0) {
+				if(motor_on) ok = hal_ok(svc->off());
+				motor_on = false;
+			} else if(s.kind == STEP_AMPLITUDE) {
+				// Before on(), or the start would be at the old amplitude
+				if(s.amplitude != amplitude) ok = hal_ok(svc->setAmplitude(s.amplitude));
+				amplitude = s.amplitude;
+				if(!motor_on) ok &= hal_ok(svc->on(run_ms(steps, i, repeat - rep - 1)));
+				motor_on = true;
+			} else if(s.kind == STEP_PERFORM) {
+				uint32_t length = 0;
+				Status status = Status::UNKNOWN_ERROR;
+				ok = svc->perform(static_cast<android::hardware::vibrator::V1_0::Effect>(s.effect),
+						static_cast<android::hardware::vibrator::V1_0::EffectStrength>(s.strength),
+						[&status, &length](auto st, auto lengthMs) {
+							status = st;
+							length = lengthMs;
+						}).isOk() && status == Status::OK;
+				if(!ok) length = 0;
+				if(ms == 0) ms = length;
+				motor_on = false;
+				amplitude = -1;
+			} else {
+				// Effects set their own amplitude
+				hidl_vec<uint8_t> data(s.data);
+				ok = hal_ok(svc->playEffectWithStrength(data, s.effect, s.strength));
+				motor_on = false;
+				amplitude = -1;
+			}
+			uint64_t t1 = now_ns();
+			if(!ok) failures++;
+			late.push_back(t0 - deadline);
+			call.push_back(t1 - t0);
+			if(verbose)
+				printf("%d.%zu at +%lluus: late %lluus, HAL %lluus%s\n", rep, i,
+						(unsigned long long)((deadline - start) / 1000), (unsigned long long)((t0 - deadline) / 1000),
+						(unsigned long long)((t1 - t0) / 1000), ok ? "" : ", failed");
+			deadline += ms * 1000000ULL;
+		}
+	}
+	if(!wait_until(fd, deadline)) return 1;
+	uint64_t end = now_ns();
+	if(motor_on && !hal_ok(svc->off())) failures++;
+	close(fd);
+
+	printf("%zu steps in %llums, scheduled %llums, %d failed\n", late.size(),
+			(unsigned long long)((end - start) / 1000000), (unsigned long long)((deadline - start) / 1000000), failures);
+	print_stats("start late", late);
+	print_stats("HAL call", call);
+	return failures ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
+	if(argc < 2) {
+		std::cerr << "Usage: vibrator-lge on [MS] | amplitude [AMP] | seq ..." << std::endl;
+		return 1;
+	}
 	auto svc = IVibratorEx::getService();
+	if(svc == nullptr) {
+		std::cerr << "No IVibratorEx" << std::endl;
+		return 1;
+	}
 
 	auto supportsAmplitude = svc->supportsAmplitudeControl();
 	if(supportsAmplitude.isOk())
@@ -42,6 +276,8 @@ public int playEffectWithStrength(ArrayList<Byte> effectData, int effectIndex, i
 		} else {
 			std::cerr << "Binder failed request" << std::endl;
 		}
+	} else if(strcmp(argv[1], "seq") == 0) {
+		return sequence(svc, argc - 2, argv + 2);
 	} else {
 		std::cerr << "Not supported (yet)" << std::endl;
 	}
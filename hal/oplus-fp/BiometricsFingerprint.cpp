@@ -13,16 +13,23 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
-#define LOG_TAG "android.hardware.biometrics.fingerprint@2.1-service.oplus.compat"
-#define LOG_VERBOSE "android.hardware.biometrics.fingerprint@2.1-service.oplus.compat"
 
 #include <hardware/hardware.h>
 #include <hardware/fingerprint.h>
 #include "BiometricsFingerprint.h"
+#include "TouchNotifier.h"
+#include "Trace.h"
+#include "Vendor.h"
 
 #include <inttypes.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <utils/Log.h>
+#include <android/hidl/manager/1.0/IServiceManager.h>
+#include <hidl/ServiceManagement.h>
+#include <android-base/properties.h>
+#include <algorithm>
+#include <chrono>
 #include <thread>
 
 namespace android {
@@ -32,233 +39,717 @@ namespace fingerprint {
 namespace V2_1 {
 namespace implementation {
 
-BiometricsFingerprint::BiometricsFingerprint() {
-    for(int i=0; i<10; i++) {
-        mOplusBiometricsFingerprint = vendor::oplus::hardware::biometrics::fingerprint::V2_1::IBiometricsFingerprint::tryGetService();
-        if(mOplusBiometricsFingerprint != nullptr) break;
-        sleep(10);
+#define FP_ENUM(type, name) { V::type::name, type::name }
+
+template<typename V>
+struct Convert {
+    static constexpr EnumTable<typename V::RequestStatus, RequestStatus, 13> requestStatus = {{
+        FP_ENUM(RequestStatus, SYS_UNKNOWN),
+        FP_ENUM(RequestStatus, SYS_OK),
+        FP_ENUM(RequestStatus, SYS_ENOENT),
+        FP_ENUM(RequestStatus, SYS_EINTR),
+        FP_ENUM(RequestStatus, SYS_EIO),
+        FP_ENUM(RequestStatus, SYS_EAGAIN),
+        FP_ENUM(RequestStatus, SYS_ENOMEM),
+        FP_ENUM(RequestStatus, SYS_EACCES),
+        FP_ENUM(RequestStatus, SYS_EFAULT),
+        FP_ENUM(RequestStatus, SYS_EBUSY),
+        FP_ENUM(RequestStatus, SYS_EINVAL),
+        FP_ENUM(RequestStatus, SYS_ENOSPC),
+        FP_ENUM(RequestStatus, SYS_ETIMEDOUT),
+    }, RequestStatus::SYS_UNKNOWN };
+
+    static constexpr EnumTable<typename V::FingerprintError, FingerprintError, 9> error = {{
+        FP_ENUM(FingerprintError, ERROR_NO_ERROR),
+        FP_ENUM(FingerprintError, ERROR_HW_UNAVAILABLE),
+        FP_ENUM(FingerprintError, ERROR_UNABLE_TO_PROCESS),
+        FP_ENUM(FingerprintError, ERROR_TIMEOUT),
+        FP_ENUM(FingerprintError, ERROR_NO_SPACE),
+        FP_ENUM(FingerprintError, ERROR_CANCELED),
+        FP_ENUM(FingerprintError, ERROR_UNABLE_TO_REMOVE),
+        FP_ENUM(FingerprintError, ERROR_LOCKOUT),
+        FP_ENUM(FingerprintError, ERROR_VENDOR),
+    }, FingerprintError::ERROR_NO_ERROR };
+
+    static constexpr EnumTable<typename V::FingerprintAcquiredInfo, FingerprintAcquiredInfo, 7> acquiredInfo = {{
+        FP_ENUM(FingerprintAcquiredInfo, ACQUIRED_GOOD),
+        FP_ENUM(FingerprintAcquiredInfo, ACQUIRED_PARTIAL),
+        FP_ENUM(FingerprintAcquiredInfo, ACQUIRED_INSUFFICIENT),
+        FP_ENUM(FingerprintAcquiredInfo, ACQUIRED_IMAGER_DIRTY),
+        FP_ENUM(FingerprintAcquiredInfo, ACQUIRED_TOO_SLOW),
+        FP_ENUM(FingerprintAcquiredInfo, ACQUIRED_TOO_FAST),
+        FP_ENUM(FingerprintAcquiredInfo, ACQUIRED_VENDOR),
+    }, FingerprintAcquiredInfo::ACQUIRED_GOOD };
+};
+
+#undef FP_ENUM
+
+static_assert(Convert<Vendor>::error(Vendor::FingerprintError::ERROR_CANCELED) == FingerprintError::ERROR_CANCELED,
+        "Vendor enum table is broken");
+
+void PendingOperation::begin() {
+    std::lock_guard<std::mutex> lock(mLock);
+    mState = State::Running;
+}
+
+void PendingOperation::abandon() {
+    std::lock_guard<std::mutex> lock(mLock);
+    mState = State::Idle;
+}
+
+bool PendingOperation::deliver(bool last) {
+    std::lock_guard<std::mutex> lock(mLock);
+    bool ended = mState == State::Done || mState == State::Synthesized;
+    if(ended && std::chrono::steady_clock::now() >= mLateUntil)
+        mState = State::Idle;
+    switch(mState) {
+        case State::Idle:
+            return true;
+        case State::Running:
+            if(last) {
+                mState = State::Done;
+                // waitOrExpire() sets the real deadline
+                mLateUntil = std::chrono::steady_clock::time_point::max();
+                mCond.notify_all();
+            }
+            return true;
+        case State::Done:
+            // Vendor HALs that confirm twice
+            return false;
+        case State::Synthesized:
+            // Keeps mLateUntil, in case it confirms twice too
+            if(last) mState = State::Done;
+            return false;
+    }
+    return true;
+}
+
+bool PendingOperation::waitOrExpire(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mLock);
+    mCond.wait_for(lock, timeout, [this] { return mState != State::Running; });
+    mLateUntil = std::chrono::steady_clock::now() + timeout * kLateFactor;
+    if(mState != State::Running) return false;
+    mState = State::Synthesized;
+    return true;
+}
+
+void TemplateCache::setDeviceId(uint64_t deviceId) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mDeviceId = deviceId;
+}
+
+uint64_t TemplateCache::deviceId() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mDeviceId;
+}
+
+void TemplateCache::replace(uint32_t gid, const std::vector<uint32_t>& fingers) {
+    std::lock_guard<std::mutex> lock(mLock);
+    Group& group = mGroups[gid];
+    group.valid = true;
+    group.fingers = fingers;
+}
+
+void TemplateCache::enumerated(uint32_t gid, uint32_t fid, uint32_t remaining) {
+    std::lock_guard<std::mutex> lock(mLock);
+    // fid 0 is how an empty group is reported
+    if(fid != 0) mEnumerated.push_back(fid);
+    if(remaining != 0) return;
+    Group& group = mGroups[gid];
+    group.valid = true;
+    group.fingers.swap(mEnumerated);
+    mEnumerated.clear();
+}
+
+void TemplateCache::discardEnumerated() {
+    std::lock_guard<std::mutex> lock(mLock);
+    mEnumerated.clear();
+}
+
+void TemplateCache::added(uint32_t gid, uint32_t fid) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mGroups.find(gid);
+    if(it == mGroups.end() || !it->second.valid) return;
+    auto& fingers = it->second.fingers;
+    if(std::find(fingers.begin(), fingers.end(), fid) == fingers.end())
+        fingers.push_back(fid);
+}
+
+void TemplateCache::removed(uint32_t gid, uint32_t fid) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mGroups.find(gid);
+    if(it == mGroups.end()) return;
+    // Some HALs report a whole-group removal as fid 0
+    if(fid == 0) {
+        it->second.valid = false;
+        return;
     }
-    if(mOplusBiometricsFingerprint == nullptr) exit(0);
+    auto& fingers = it->second.fingers;
+    fingers.erase(std::remove(fingers.begin(), fingers.end(), fid), fingers.end());
 }
 
-static bool receivedCancel;
-static bool receivedEnumerate;
-static uint64_t myDeviceId;
-static std::vector<uint32_t> knownFingers;
-class OplusClientCallback : public vendor::oplus::hardware::biometrics::fingerprint::V2_1::IBiometricsFingerprintClientCallback {
+void TemplateCache::invalidate(uint32_t gid) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mGroups.find(gid);
+    if(it != mGroups.end()) it->second.valid = false;
+}
+
+void TemplateCache::invalidateAll() {
+    std::lock_guard<std::mutex> lock(mLock);
+    for(auto& group: mGroups)
+        group.second.valid = false;
+    mEnumerated.clear();
+}
+
+bool TemplateCache::get(uint32_t gid, std::vector<uint32_t> *fingers) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mGroups.find(gid);
+    if(it == mGroups.end() || !it->second.valid) return false;
+    *fingers = it->second.fingers;
+    return true;
+}
+
+void TemplateCache::dump(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+    dprintf(fd, "Device id: %" PRIu64 ", templates:\n", mDeviceId);
+    for(auto& group: mGroups) {
+        dprintf(fd, "  group %u (%s):", group.first, group.second.valid ? "valid" : "stale");
+        for(auto finger: group.second.fingers)
+            dprintf(fd, " %u", finger);
+        dprintf(fd, "\n");
+    }
+}
+
+template<typename V>
+class VendorClientCallback : public V::IBiometricsFingerprintClientCallback {
 public:
-    sp<android::hardware::biometrics::fingerprint::V2_1::IBiometricsFingerprintClientCallback> mClientCallback;
+    sp<IBiometricsFingerprintClientCallback> mClientCallback;
+
+    // The service object lives until the process exits
+    VendorClientCallback(sp<IBiometricsFingerprintClientCallback> clientCallback, BiometricsFingerprint<V> *parent) :
+        mClientCallback(clientCallback), mParent(parent) {}
+
+    template<typename Fn>
+    void forward(Fn fn) {
+        sp<IBiometricsFingerprintClientCallback> client = mClientCallback;
+        if(client == nullptr) return;
+        mParent->mCallbacks.post([client, fn] { fn(client); });
+    }
 
-    OplusClientCallback(sp<android::hardware::biometrics::fingerprint::V2_1::IBiometricsFingerprintClientCallback> clientCallback) : mClientCallback(clientCallback) {}
     Return<void> onEnrollResult(uint64_t deviceId, uint32_t fingerId,
-        uint32_t groupId, uint32_t remaining) {
-        ALOGE("onEnrollResult %" PRIu64 " %u %u %u", deviceId, fingerId, groupId, remaining);
-        if(mClientCallback != nullptr)
-            mClientCallback->onEnrollResult(deviceId, fingerId, groupId, remaining);
+        uint32_t groupId, uint32_t remaining) override {
+        FP_LOG("onEnrollResult %" PRIu64 " %u %u %u", deviceId, fingerId, groupId, remaining);
+        trace(TraceEvent::OnEnrollResult, fingerId, groupId, remaining);
+        if(remaining == 0 && fingerId != 0)
+            mParent->mTemplates.added(groupId, fingerId);
+        forward([=](auto client) { client->onEnrollResult(deviceId, fingerId, groupId, remaining); });
         return Void();
     }
 
-    Return<void> onAcquired(uint64_t deviceId, vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo acquiredInfo,
-        int32_t vendorCode) {
-        ALOGE("onAcquired %" PRIu64 " %d", deviceId, vendorCode);
-        if(mClientCallback != nullptr)
-            mClientCallback->onAcquired(deviceId, OplusToAOSPFingerprintAcquiredInfo(acquiredInfo), vendorCode);
+    Return<void> onAcquired(uint64_t deviceId, typename V::FingerprintAcquiredInfo acquiredInfo,
+        int32_t vendorCode) override {
+        FP_LOG("onAcquired %" PRIu64 " %d", deviceId, vendorCode);
+        trace(TraceEvent::OnAcquired, (int32_t)acquiredInfo, vendorCode);
+        FingerprintAcquiredInfo info = Convert<V>::acquiredInfo(acquiredInfo);
+        forward([=](auto client) { client->onAcquired(deviceId, info, vendorCode); });
         return Void();
     }
 
     Return<void> onAuthenticated(uint64_t deviceId, uint32_t fingerId, uint32_t groupId,
-        const hidl_vec<uint8_t>& token) {
-        ALOGE("onAuthenticated %" PRIu64 " %u %u", deviceId, fingerId, groupId);
-        if(mClientCallback != nullptr)
-            mClientCallback->onAuthenticated(deviceId, fingerId, groupId, token);
+        const hidl_vec<uint8_t>& token) override {
+        FP_LOG("onAuthenticated %" PRIu64 " %u %u", deviceId, fingerId, groupId);
+        trace(TraceEvent::OnAuthenticated, fingerId, groupId);
+        forward([=](auto client) { client->onAuthenticated(deviceId, fingerId, groupId, token); });
         return Void();
     }
 
-    Return<void> onError(uint64_t deviceId, vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError error, int32_t vendorCode) {
-        ALOGE("onError %" PRIu64 " %d", deviceId, vendorCode);
-        if(error == vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_CANCELED) {
-            receivedCancel = true;
+    Return<void> onError(uint64_t deviceId, typename V::FingerprintError error, int32_t vendorCode) override {
+        FP_LOG("onError %" PRIu64 " %d", deviceId, vendorCode);
+        trace(TraceEvent::OnError, (int32_t)error, vendorCode);
+        // The framework didn't ask for our refresh, so it mustn't see it canceled either.
+        // A cancel() racing with it gets its callback synthesized.
+        if(error == V::FingerprintError::ERROR_CANCELED && mParent->mRefreshing) {
+            FP_LOG("Dropping cancel of the template refresh");
+            trace(TraceEvent::DroppedLate, (int)TraceEvent::OnError, 1);
+            mParent->mEnumerate.deliver(true);
+            return Void();
         }
-        if(mClientCallback != nullptr)
-            mClientCallback->onError(deviceId, OplusToAOSPFingerprintError(error), vendorCode);
+        if(error == V::FingerprintError::ERROR_CANCELED && !mParent->mCancel.deliver(true)) {
+            FP_LOG("Dropping late cancel, already sent ours");
+            trace(TraceEvent::DroppedLate, (int)TraceEvent::OnError);
+            return Void();
+        }
+        FingerprintError aospError = Convert<V>::error(error);
+        forward([=](auto client) { client->onError(deviceId, aospError, vendorCode); });
         return Void();
     }
 
     Return<void> onRemoved(uint64_t deviceId, uint32_t fingerId, uint32_t groupId,
-        uint32_t remaining) {
-        ALOGE("onRemoved %" PRIu64 " %" PRIu32, deviceId, fingerId);
-        if(mClientCallback != nullptr)
-            mClientCallback->onRemoved(deviceId, fingerId, groupId, remaining);
+        uint32_t remaining) override {
+        FP_LOG("onRemoved %" PRIu64 " %" PRIu32, deviceId, fingerId);
+        trace(TraceEvent::OnRemoved, fingerId, groupId, remaining);
+        mParent->mTemplates.removed(groupId, fingerId);
+        forward([=](auto client) { client->onRemoved(deviceId, fingerId, groupId, remaining); });
         return Void();
     }
 
     Return<void> onEnumerate(uint64_t deviceId, uint32_t fingerId, uint32_t groupId,
-        uint32_t remaining) {
-        receivedEnumerate = true;
-        ALOGE("onEnumerate %" PRIu64 " %u %u %u", deviceId, fingerId, groupId, remaining);
-        if(mClientCallback != nullptr)
-            mClientCallback->onEnumerate(deviceId, fingerId, groupId, remaining);
+        uint32_t remaining) override {
+        FP_LOG("onEnumerate %" PRIu64 " %u %u %u", deviceId, fingerId, groupId, remaining);
+        trace(TraceEvent::OnEnumerate, fingerId, groupId, remaining);
+        // Read before deliver(), which lets the refresh end
+        bool refresh = mParent->mRefreshing;
+        if(!mParent->mEnumerate.deliver(remaining == 0)) {
+            FP_LOG("Dropping late enumerate, already sent ours");
+            trace(TraceEvent::DroppedLate, (int)TraceEvent::OnEnumerate);
+            return Void();
+        }
+        mParent->mTemplates.enumerated(groupId, fingerId, remaining);
+        // The framework already got these from the cache
+        if(refresh) return Void();
+        forward([=](auto client) { client->onEnumerate(deviceId, fingerId, groupId, remaining); });
         return Void();
     }
 
-    Return<void> onTouchUp(uint64_t deviceId) { return Void(); }
-    Return<void> onTouchDown(uint64_t deviceId) { return Void(); }
-    Return<void> onSyncTemplates(uint64_t deviceId, const hidl_vec<uint32_t>& fingerId, uint32_t remaining) {
-        ALOGE("onSyncTemplates %" PRIu64 " %zu %" PRIu32, deviceId, fingerId.size(), remaining);
-        myDeviceId = deviceId;
-
-        for(auto fid : fingerId) {
-            ALOGE("\t- %u", fid);
+    // The AIDL front-end takes touches from the framework's onPointerDown/Up
+    // and onUiReady instead, these would report each of them a second time
+    Return<void> onTouchUp(uint64_t deviceId) override {
+#if !FP_FRONTEND_AIDL
+        mParent->mTouch.touchUp();
+#endif
+        return Void();
+    }
+    Return<void> onTouchDown(uint64_t deviceId) override {
+#if !FP_FRONTEND_AIDL
+        mParent->mTouch.touchDown();
+#endif
+        return Void();
+    }
+    Return<void> onSyncTemplates(uint64_t deviceId, const hidl_vec<uint32_t>& fingerId, uint32_t remaining) override {
+        FP_LOG("onSyncTemplates %" PRIu64 " %zu %" PRIu32, deviceId, fingerId.size(), remaining);
+        trace(TraceEvent::OnSyncTemplates, fingerId.size(), remaining);
+        if(verboseLogging()) {
+            for(auto fid : fingerId) {
+                ALOGD("\t- %u", fid);
+            }
         }
-        knownFingers = fingerId;
-
+        mParent->mTemplates.setDeviceId(deviceId);
+        mParent->mTemplates.replace(mParent->activeGroup(), fingerId);
+        return Void();
+    }
+    Return<void> onFingerprintCmd(int32_t deviceId, const hidl_vec<uint32_t>& groupId, uint32_t remaining) override { return Void(); }
+    Return<void> onImageInfoAcquired(uint32_t type, uint32_t quality, uint32_t match_score) override { return Void(); }
+    Return<void> onMonitorEventTriggered(uint32_t type, const hidl_string& data) override { return Void(); }
+    Return<void> onEngineeringInfoUpdated(uint32_t length, const hidl_vec<uint32_t>& keys, const hidl_vec<hidl_string>& values) override { return Void(); }
+    Return<void> onUIReady(int64_t deviceId) override {
+#if !FP_FRONTEND_AIDL
+        mParent->mTouch.uiReady();
+#endif
         return Void();
     }
-    Return<void> onFingerprintCmd(int32_t deviceId, const hidl_vec<uint32_t>& groupId, uint32_t remaining) { return Void(); }
-    Return<void> onImageInfoAcquired(uint32_t type, uint32_t quality, uint32_t match_score) { return Void(); }
-    Return<void> onMonitorEventTriggered(uint32_t type, const hidl_string& data) { return Void(); }
-    Return<void> onEngineeringInfoUpdated(uint32_t length, const hidl_vec<uint32_t>& keys, const hidl_vec<hidl_string>& values) { return Void(); }
-    Return<void> onUIReady(int64_t deviceId) { return Void(); }
 
 private:
+    BiometricsFingerprint<V> *mParent;
+};
 
-    Return<android::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo> OplusToAOSPFingerprintAcquiredInfo(vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo info) {
-        switch(info) {
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_GOOD: return android::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_GOOD;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_PARTIAL: return android::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_PARTIAL;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_INSUFFICIENT: return android::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_INSUFFICIENT;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_IMAGER_DIRTY: return android::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_IMAGER_DIRTY;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_TOO_SLOW: return android::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_TOO_SLOW;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_TOO_FAST: return android::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_TOO_FAST;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_VENDOR: return android::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_VENDOR;
-            default:
-                return android::hardware::biometrics::fingerprint::V2_1::FingerprintAcquiredInfo::ACQUIRED_GOOD;
-        }
+using ::android::hidl::manager::V1_0::IServiceManager;
+using ::android::hidl::manager::V1_0::IServiceNotification;
+using ::android::hidl::base::V1_0::IBase;
+
+// How long a framework call waits for a restarting vendor HAL
+static constexpr std::chrono::seconds kVendorWait(5);
+// How long a background template refresh may take before we stop listening
+static constexpr std::chrono::seconds kRefreshTimeout(2);
+
+template<typename V>
+class VendorServiceNotification : public IServiceNotification {
+public:
+    // The service object lives until the process exits
+    VendorServiceNotification(BiometricsFingerprint<V> *parent) : mParent(parent) {}
+    Return<void> onRegistration(const hidl_string& fqName, const hidl_string& name, bool preexisting) override {
+        ALOGI("%s/%s registered%s", fqName.c_str(), name.c_str(), preexisting ? " (already running)" : "");
+        mParent->onVendorRegistered();
+        return Void();
     }
+private:
+    BiometricsFingerprint<V> *mParent;
+};
 
-    Return<android::hardware::biometrics::fingerprint::V2_1::FingerprintError> OplusToAOSPFingerprintError(vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError error) {
-        switch(error) {
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_NO_ERROR: return android::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_NO_ERROR;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_HW_UNAVAILABLE: return android::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_HW_UNAVAILABLE;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_UNABLE_TO_PROCESS: return android::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_UNABLE_TO_PROCESS;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_TIMEOUT: return android::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_TIMEOUT;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_NO_SPACE: return android::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_NO_SPACE;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_CANCELED: return android::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_CANCELED;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_UNABLE_TO_REMOVE: return android::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_UNABLE_TO_REMOVE;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_LOCKOUT: return android::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_LOCKOUT;
-            case vendor::oplus::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_VENDOR: return android::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_VENDOR;
-            default:
-                return android::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_NO_ERROR;
-        }
+template<typename V>
+class VendorDeathRecipient : public hidl_death_recipient {
+public:
+    VendorDeathRecipient(BiometricsFingerprint<V> *parent) : mParent(parent) {}
+    void serviceDied(uint64_t cookie, const wp<IBase>& who) override {
+        mParent->onVendorDied(cookie);
     }
+private:
+    BiometricsFingerprint<V> *mParent;
 };
 
-Return<uint64_t> BiometricsFingerprint::setNotify(
-        const sp<IBiometricsFingerprintClientCallback>& clientCallback) {
-    ALOGE("setNotify");
-    mOplusClientCallback = new OplusClientCallback(clientCallback);
-    return mOplusBiometricsFingerprint->setNotify(mOplusClientCallback);
+template<typename V>
+BiometricsFingerprint<V>::BiometricsFingerprint() {
+    mCallbackTimeout = std::chrono::milliseconds(
+            android::base::GetIntProperty("persist.sys.phh.fingerprint.callback_timeout_ms", 100));
+    mServiceNotification = new VendorServiceNotification<V>(this);
+    mDeathRecipient = new VendorDeathRecipient<V>(this);
 }
 
-Return<RequestStatus> BiometricsFingerprint::OplusToAOSPRequestStatus(vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus req) {
-    switch(req) {
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_UNKNOWN: return RequestStatus::SYS_UNKNOWN;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_OK: return RequestStatus::SYS_OK;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_ENOENT: return RequestStatus::SYS_ENOENT;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_EINTR: return RequestStatus::SYS_EINTR;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_EIO: return RequestStatus::SYS_EIO;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_EAGAIN: return RequestStatus::SYS_EAGAIN;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_ENOMEM: return RequestStatus::SYS_ENOMEM;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_EACCES: return RequestStatus::SYS_EACCES;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_EFAULT: return RequestStatus::SYS_EFAULT;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_EBUSY: return RequestStatus::SYS_EBUSY;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_EINVAL: return RequestStatus::SYS_EINVAL;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_ENOSPC: return RequestStatus::SYS_ENOSPC;
-        case vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus::SYS_ETIMEDOUT: return RequestStatus::SYS_ETIMEDOUT;
-        default:
-            return RequestStatus::SYS_UNKNOWN;
+template<typename V>
+bool BiometricsFingerprint<V>::start(std::function<void()> publish) {
+    mPublish = publish;
+    auto transport = android::hardware::defaultServiceManager()->getTransport(V::IBiometricsFingerprint::descriptor, "default");
+    if(!transport.isOk() || transport == IServiceManager::Transport::EMPTY) {
+        ALOGE("%s is not declared on this device", V::IBiometricsFingerprint::descriptor);
+        return false;
+    }
+    // Also fires right away if it is already running
+    if(!V::IBiometricsFingerprint::registerForNotifications("default", mServiceNotification)) {
+        ALOGE("Failed registering for %s notifications", V::IBiometricsFingerprint::descriptor);
+        return false;
+    }
+    return true;
+}
+
+template<typename V>
+void BiometricsFingerprint<V>::onVendorRegistered() {
+    sp<typename V::IBiometricsFingerprint> hal = V::IBiometricsFingerprint::tryGetService();
+    if(hal == nullptr) return;
+
+    sp<IBiometricsFingerprintClientCallback> client;
+    bool haveActiveGroup;
+    uint32_t activeGroup;
+    hidl_string storePath;
+    {
+        std::lock_guard<std::mutex> lock(mVendorLock);
+        if(hal == mVendorBiometricsFingerprint) return;
+        client = mClientCallback;
+        haveActiveGroup = mHaveActiveGroup;
+        activeGroup = mActiveGroup;
+        storePath = mStorePath;
+    }
+
+    // A restarted HAL forgot everything, bring it back to where the framework left it
+    sp<VendorClientCallback<V>> callback;
+    if(client != nullptr) {
+        callback = new VendorClientCallback<V>(client, this);
+        hal->setNotify(callback);
+    }
+    if(haveActiveGroup)
+        hal->setActiveGroup(activeGroup, storePath);
+
+    uint64_t generation;
+    bool registerNow;
+    {
+        std::lock_guard<std::mutex> lock(mVendorLock);
+        generation = ++mVendorGeneration;
+        mVendorBiometricsFingerprint = hal;
+        if(callback != nullptr)
+            mVendorClientCallback = callback;
+        registerNow = !mRegistered;
+        mRegistered = true;
+    }
+    mVendorCond.notify_all();
+    hal->linkToDeath(mDeathRecipient, generation);
+    trace(TraceEvent::VendorRegistered, generation);
+
+    if(registerNow && mPublish) {
+        mPublish();
+    } else if(registerNow) {
+        status_t status = this->registerAsService();
+        if(status != OK)
+            ALOGE("Could not register service for Fingerprint HAL Adapter BiometricsFingerprint Iface (%d)", status);
+        else
+            ALOGI("Fingerprint HAL Adapter service is ready.");
+    }
+}
+
+template<typename V>
+void BiometricsFingerprint<V>::onVendorDied(uint64_t generation) {
+    sp<IBiometricsFingerprintClientCallback> client;
+    {
+        std::lock_guard<std::mutex> lock(mVendorLock);
+        // A late notification for an instance we already replaced
+        if(generation != mVendorGeneration) return;
+        mVendorBiometricsFingerprint.clear();
+        mVendorClientCallback.clear();
+        client = mClientCallback;
+    }
+    // The restarted HAL syncs its templates again once it gets the active group
+    mTemplates.invalidateAll();
+    ALOGW("Vendor fingerprint HAL died, waiting for it to come back");
+    trace(TraceEvent::VendorDied, generation);
+    // Whatever was running won't complete, tell the framework
+    if(client != nullptr) {
+        uint64_t devId = mTemplates.deviceId();
+        mCallbacks.post([client, devId] { client->onError(devId, FingerprintError::ERROR_HW_UNAVAILABLE, 0); });
+    }
+}
+
+template<typename V>
+sp<typename V::IBiometricsFingerprint> BiometricsFingerprint<V>::vendorHal() {
+    std::unique_lock<std::mutex> lock(mVendorLock);
+    if(!mVendorCond.wait_for(lock, kVendorWait, [this] { return mVendorBiometricsFingerprint != nullptr; }))
+        ALOGE("Vendor fingerprint HAL is gone");
+    return mVendorBiometricsFingerprint;
+}
+
+// A dead vendor HAL reads as a failed request rather than aborting us
+template<typename V>
+static RequestStatus toRequestStatus(const Return<typename V::RequestStatus>& ret) {
+    if(!ret.isOk()) return RequestStatus::SYS_UNKNOWN;
+    return Convert<V>::requestStatus(ret);
+}
+
+template<typename V>
+Return<uint64_t> BiometricsFingerprint<V>::setNotify(
+        const sp<IBiometricsFingerprintClientCallback>& clientCallback) {
+    FP_LOG("setNotify");
+    trace(TraceEvent::SetNotify);
+    sp<VendorClientCallback<V>> callback = new VendorClientCallback<V>(clientCallback, this);
+    {
+        std::lock_guard<std::mutex> lock(mVendorLock);
+        mClientCallback = clientCallback;
+        mVendorClientCallback = callback;
     }
+    auto hal = vendorHal();
+    if(hal == nullptr) return 0;
+    return hal->setNotify(callback).withDefault(0);
 }
 
-Return<uint64_t> BiometricsFingerprint::preEnroll()  {
-    ALOGE("preEnroll");
-    return mOplusBiometricsFingerprint->preEnroll();
+template<typename V>
+Return<uint64_t> BiometricsFingerprint<V>::preEnroll()  {
+    FP_LOG("preEnroll");
+    trace(TraceEvent::PreEnroll);
+    auto hal = vendorHal();
+    if(hal == nullptr) return 0;
+    return hal->preEnroll().withDefault(0);
 }
 
-Return<RequestStatus> BiometricsFingerprint::enroll(const hidl_array<uint8_t, 69>& hat,
+template<typename V>
+Return<RequestStatus> BiometricsFingerprint<V>::enroll(const hidl_array<uint8_t, 69>& hat,
     uint32_t gid, uint32_t timeoutSec)  {
-    ALOGE("enroll");
-    return OplusToAOSPRequestStatus(mOplusBiometricsFingerprint->enroll(hat, gid, timeoutSec));
+    FP_LOG("enroll");
+    trace(TraceEvent::Enroll, gid, timeoutSec);
+    auto hal = vendorHal();
+    if(hal == nullptr) return RequestStatus::SYS_UNKNOWN;
+    return toRequestStatus<V>(hal->enroll(hat, gid, timeoutSec));
 }
 
-Return<RequestStatus> BiometricsFingerprint::postEnroll()  {
-    ALOGE("postEnroll");
-    return OplusToAOSPRequestStatus(mOplusBiometricsFingerprint->postEnroll());
+template<typename V>
+Return<RequestStatus> BiometricsFingerprint<V>::postEnroll()  {
+    FP_LOG("postEnroll");
+    trace(TraceEvent::PostEnroll);
+    auto hal = vendorHal();
+    if(hal == nullptr) return RequestStatus::SYS_UNKNOWN;
+    return toRequestStatus<V>(hal->postEnroll());
 }
 
-Return<uint64_t> BiometricsFingerprint::getAuthenticatorId()  {
-    ALOGE("getAuthId");
-    return mOplusBiometricsFingerprint->getAuthenticatorId();
+template<typename V>
+Return<uint64_t> BiometricsFingerprint<V>::getAuthenticatorId()  {
+    FP_LOG("getAuthId");
+    trace(TraceEvent::GetAuthenticatorId);
+    auto hal = vendorHal();
+    if(hal == nullptr) return 0;
+    return hal->getAuthenticatorId().withDefault(0);
 }
 
-Return<RequestStatus> BiometricsFingerprint::cancel()  {
-    receivedCancel = false;
-    RequestStatus ret = OplusToAOSPRequestStatus(mOplusBiometricsFingerprint->cancel());
-    ALOGE("CANCELING");
-    if(!receivedCancel) {
-        ALOGE("Sending cancel error");
-        mOplusClientCallback->mClientCallback->onError(
-                myDeviceId,
-                android::hardware::biometrics::fingerprint::V2_1::FingerprintError::ERROR_CANCELED,
-                0);
+template<typename V>
+Return<RequestStatus> BiometricsFingerprint<V>::cancel()  {
+    auto hal = vendorHal();
+    if(hal == nullptr) return RequestStatus::SYS_UNKNOWN;
+    mCancel.begin();
+    RequestStatus ret = toRequestStatus<V>(hal->cancel());
+    FP_LOG("CANCELING");
+    trace(TraceEvent::Cancel, (int32_t)ret);
+    // Some vendor HALs never confirm a cancel, but the framework waits for it
+    sp<IBiometricsFingerprintClientCallback> client = clientCallback();
+    if(mCancel.waitOrExpire(mCallbackTimeout) && client != nullptr) {
+        FP_LOG("Sending cancel error");
+        trace(TraceEvent::SyntheticCancel);
+        uint64_t devId = mTemplates.deviceId();
+        mCallbacks.post([client, devId] { client->onError(devId, FingerprintError::ERROR_CANCELED, 0); });
     }
     return ret;
 }
 
-Return<RequestStatus> BiometricsFingerprint::enumerate()  {
-    receivedEnumerate = false;
-    RequestStatus ret = OplusToAOSPRequestStatus(mOplusBiometricsFingerprint->enumerate());
-    ALOGE("ENUMERATING");
-    if(ret == RequestStatus::SYS_OK && !receivedEnumerate) {
-        size_t nFingers = knownFingers.size();
-        ALOGE("received fingers, sending our own %zu", nFingers);
+template<typename V>
+Return<RequestStatus> BiometricsFingerprint<V>::enumerate()  {
+    auto hal = vendorHal();
+    if(hal == nullptr) return RequestStatus::SYS_UNKNOWN;
+    sp<IBiometricsFingerprintClientCallback> client = clientCallback();
+    uint32_t gid = activeGroup();
+
+    std::unique_lock<std::mutex> lock(mEnumerateLock);
+
+    // Called on every boot and user switch, and the TEE round trip is slow
+    std::vector<uint32_t> fingers;
+    if(client != nullptr && mTemplates.get(gid, &fingers)) {
+        FP_LOG("ENUMERATING from cache, %zu fingers", fingers.size());
+        trace(TraceEvent::CachedEnumerate, gid, fingers.size());
+        sendEnumerate(client, gid, fingers);
+        if(!mRefreshing)
+            refreshTemplates(hal);
+        return RequestStatus::SYS_OK;
+    }
+
+    // One vendor enumerate at a time, this one is for the framework
+    mRefreshDone.wait(lock, [this] { return !mRefreshing; });
+
+    mEnumerate.begin();
+    mTemplates.discardEnumerated();
+    RequestStatus ret = toRequestStatus<V>(hal->enumerate());
+    FP_LOG("ENUMERATING");
+    trace(TraceEvent::Enumerate, (int32_t)ret);
+    if(ret != RequestStatus::SYS_OK) {
+        mEnumerate.abandon();
+        return ret;
+    }
+    // Some vendor HALs only report templates through onSyncTemplates
+    bool expired = mEnumerate.waitOrExpire(mCallbackTimeout);
+    // What did arrive would end up in the next enumerate's list.
+    // The rest is dropped by mEnumerate.deliver()
+    if(expired) mTemplates.discardEnumerated();
+    if(expired && client != nullptr) {
+        if(mTemplates.get(gid, &fingers)) {
+            FP_LOG("received fingers, sending our own %zu", fingers.size());
+            trace(TraceEvent::SyntheticEnumerate, fingers.size());
+            sendEnumerate(client, gid, fingers);
+        } else {
+            // An empty list would have the framework drop every template
+            ALOGE("Vendor HAL didn't report templates of group %u", gid);
+            trace(TraceEvent::SyntheticEnumerate, -1);
+            uint64_t devId = mTemplates.deviceId();
+            mCallbacks.post([client, devId] { client->onError(devId, FingerprintError::ERROR_TIMEOUT, 0); });
+        }
+    }
+    return ret;
+}
+
+// Called with mEnumerateLock held. The vendor enumerate is issued before we
+// return, so it reaches the vendor HAL ahead of the framework's next request.
+template<typename V>
+void BiometricsFingerprint<V>::refreshTemplates(sp<typename V::IBiometricsFingerprint> hal) {
+    mRefreshing = true;
+    mEnumerate.begin();
+    mTemplates.discardEnumerated();
+    RequestStatus ret = toRequestStatus<V>(hal->enumerate());
+    trace(TraceEvent::Enumerate, (int32_t)ret, 1);
+    if(ret != RequestStatus::SYS_OK) {
+        mEnumerate.abandon();
+        mRefreshing = false;
+        return;
+    }
+    std::thread([this] {
+        if(mEnumerate.waitOrExpire(kRefreshTimeout))
+            mTemplates.discardEnumerated();
+        {
+            std::lock_guard<std::mutex> lock(mEnumerateLock);
+            mRefreshing = false;
+        }
+        mRefreshDone.notify_all();
+    }).detach();
+}
+
+template<typename V>
+void BiometricsFingerprint<V>::sendEnumerate(const sp<IBiometricsFingerprintClientCallback>& client,
+        uint32_t gid, const std::vector<uint32_t>& fingers) {
+    uint64_t devId = mTemplates.deviceId();
+    mCallbacks.post([client, devId, gid, fingers] {
+        size_t nFingers = fingers.size();
         if(nFingers > 0) {
-            for(auto finger: knownFingers) {
-                mOplusClientCallback->mClientCallback->onEnumerate(
-                        myDeviceId,
+            for(auto finger: fingers) {
+                client->onEnumerate(
+                        devId,
                         finger,
-                        0,
+                        gid,
                         --nFingers);
 
             }
         } else {
-            mOplusClientCallback->mClientCallback->onEnumerate(
-                    myDeviceId,
-                    0,
+            client->onEnumerate(
+                    devId,
                     0,
+                    gid,
                     0);
 
         }
-    }
-    return ret;
+    });
+}
+
+template<typename V>
+sp<IBiometricsFingerprintClientCallback> BiometricsFingerprint<V>::clientCallback() {
+    std::lock_guard<std::mutex> lock(mVendorLock);
+    return mClientCallback;
+}
+
+template<typename V>
+uint32_t BiometricsFingerprint<V>::activeGroup() {
+    std::lock_guard<std::mutex> lock(mVendorLock);
+    return mActiveGroup;
 }
 
-Return<RequestStatus> BiometricsFingerprint::remove(uint32_t gid, uint32_t fid)  {
-    ALOGE("remove");
-    return OplusToAOSPRequestStatus(mOplusBiometricsFingerprint->remove(gid, fid));
+template<typename V>
+Return<RequestStatus> BiometricsFingerprint<V>::remove(uint32_t gid, uint32_t fid)  {
+    FP_LOG("remove");
+    trace(TraceEvent::Remove, gid, fid);
+    auto hal = vendorHal();
+    if(hal == nullptr) return RequestStatus::SYS_UNKNOWN;
+    return toRequestStatus<V>(hal->remove(gid, fid));
 }
 
-Return<RequestStatus> BiometricsFingerprint::setActiveGroup(uint32_t gid,
+template<typename V>
+Return<RequestStatus> BiometricsFingerprint<V>::setActiveGroup(uint32_t gid,
     const hidl_string& storePath)  {
-    ALOGE("setActiveGroup");
-    return OplusToAOSPRequestStatus(mOplusBiometricsFingerprint->setActiveGroup(gid, storePath));
+    FP_LOG("setActiveGroup");
+    trace(TraceEvent::SetActiveGroup, gid);
+    {
+        std::lock_guard<std::mutex> lock(mVendorLock);
+        mHaveActiveGroup = true;
+        mActiveGroup = gid;
+        mStorePath = storePath;
+    }
+    // The vendor HAL answers with onSyncTemplates for the new group
+    mTemplates.invalidate(gid);
+    auto hal = vendorHal();
+    if(hal == nullptr) return RequestStatus::SYS_UNKNOWN;
+    return toRequestStatus<V>(hal->setActiveGroup(gid, storePath));
 }
 
-Return<RequestStatus> BiometricsFingerprint::authenticate(uint64_t operationId, uint32_t gid)  {
-    ALOGE("auth");
-    return OplusToAOSPRequestStatus(mOplusBiometricsFingerprint->authenticate(operationId, gid));
+template<typename V>
+Return<RequestStatus> BiometricsFingerprint<V>::authenticate(uint64_t operationId, uint32_t gid)  {
+    FP_LOG("auth");
+    trace(TraceEvent::Authenticate, gid, operationId);
+    auto hal = vendorHal();
+    if(hal == nullptr) return RequestStatus::SYS_UNKNOWN;
+    return toRequestStatus<V>(hal->authenticate(operationId, gid));
 }
 
+template<typename V>
+Return<void> BiometricsFingerprint<V>::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) {
+    const native_handle_t *handle = fd.getNativeHandle();
+    if(handle == nullptr || handle->numFds < 1) return Void();
+    int out = handle->data[0];
+
+    {
+        std::lock_guard<std::mutex> lock(mVendorLock);
+        dprintf(out, "Vendor HAL: %s, generation %" PRIu64 "\n",
+                mVendorBiometricsFingerprint != nullptr ? "attached" : "missing", mVendorGeneration);
+        dprintf(out, "Client: %s, active group: ", mClientCallback != nullptr ? "set" : "none");
+        if(mHaveActiveGroup)
+            dprintf(out, "%u %s\n", mActiveGroup, mStorePath.c_str());
+        else
+            dprintf(out, "none\n");
+    }
+    mTemplates.dump(out);
+    dprintf(out, "Template refresh: %s\n", mRefreshing ? "running" : "idle");
+    dprintf(out, "Callback timeout: %lld ms, verbose: %d\n", (long long)mCallbackTimeout.count(), verboseLogging());
+    dprintf(out, "Callback queue: max depth %zu\n", mCallbacks.maxDepth());
+    dumpTrace(out);
+    return Void();
+}
+
+template struct BiometricsFingerprint<Vendor>;
+
 } // namespace implementation
 }  // namespace V2_1
 }  // namespace fingerprint
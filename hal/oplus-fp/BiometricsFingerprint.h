@@ -22,10 +22,20 @@
 #include <hardware/hardware.h>
 #include <hardware/fingerprint.h>
 #include <hidl/MQDescriptor.h>
+#include <hidl/HidlSupport.h>
 #include <hidl/Status.h>
+#include <android/hidl/manager/1.0/IServiceNotification.h>
 #include <android/hardware/biometrics/fingerprint/2.1/IBiometricsFingerprint.h>
 #include <android/hardware/biometrics/fingerprint/2.1/types.h>
-#include <vendor/oplus/hardware/biometrics/fingerprint/2.1/IBiometricsFingerprint.h>
+#include "CallbackQueue.h"
+#include "TouchNotifier.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
 
 namespace android {
 namespace hardware {
@@ -41,15 +51,123 @@ using ::android::hardware::Return;
 using ::android::hardware::Void;
 using ::android::hardware::hidl_vec;
 using ::android::hardware::hidl_string;
+using ::android::hardware::hidl_handle;
 using ::android::OK;
 using ::android::sp;
 using ::android::status_t;
 
-class OplusClientCallback;
+/*
+ * Maps a vendor enum to its AOSP twin. It is a short array scanned
+ * linearly, which is smaller than a switch per vendor and still
+ * evaluates at compile time for constant arguments.
+ */
+template<typename From, typename To, size_t N>
+struct EnumTable {
+    struct Entry {
+        From from;
+        To to;
+    };
+    Entry entries[N];
+    To fallback;
+
+    constexpr To operator()(From v) const {
+        for(size_t i = 0; i < N; i++)
+            if(entries[i].from == v) return entries[i].to;
+        return fallback;
+    }
+};
+
+/*
+ * One asynchronous operation that ends with a vendor callback. When the
+ * vendor HAL doesn't deliver that callback in time we synthesize it, and
+ * swallow the real one if it shows up later, so the framework sees it
+ * exactly once. Whatever the vendor HAL sends for it after it ended, a
+ * late or repeated final callback, is swallowed too. For kLateFactor
+ * timeouts only, after that a callback is the vendor's own again.
+ */
+class PendingOperation {
+public:
+    void begin();
+    void abandon();
+    // Returns false if a callback belongs to an operation we already ended ourselves
+    bool deliver(bool last);
+    // Returns true if the caller has to synthesize the final callback
+    bool waitOrExpire(std::chrono::milliseconds timeout);
+
+private:
+    static constexpr int kLateFactor = 10;
+    enum class State { Idle, Running, Done, Synthesized };
+    std::mutex mLock;
+    std::condition_variable mCond;
+    State mState = State::Idle;
+    std::chrono::steady_clock::time_point mLateUntil;
+};
+
+/*
+ * Templates per group as the vendor HAL last reported them, so enumerate()
+ * can answer without a round trip into the TEE. A group only counts once
+ * we have seen its complete list, from onSyncTemplates or an enumerate.
+ */
+class TemplateCache {
+public:
+    void setDeviceId(uint64_t deviceId);
+    uint64_t deviceId();
+
+    // The complete list of a group
+    void replace(uint32_t gid, const std::vector<uint32_t>& fingers);
+    // One onEnumerate result, the list is complete once remaining reaches 0
+    void enumerated(uint32_t gid, uint32_t fid, uint32_t remaining);
+    // Forgets the results of an enumerate that won't complete
+    void discardEnumerated();
+    void added(uint32_t gid, uint32_t fid);
+    void removed(uint32_t gid, uint32_t fid);
+    void invalidate(uint32_t gid);
+    void invalidateAll();
+
+    // Returns false if the group isn't known
+    bool get(uint32_t gid, std::vector<uint32_t> *fingers);
+    void dump(int fd);
+
+private:
+    struct Group {
+        bool valid = false;
+        std::vector<uint32_t> fingers;
+    };
+    std::mutex mLock;
+    uint64_t mDeviceId = 0;
+    std::map<uint32_t, Group> mGroups;
+    std::vector<uint32_t> mEnumerated;
+};
+
+template<typename V> class VendorClientCallback;
+template<typename V> class VendorServiceNotification;
+template<typename V> class VendorDeathRecipient;
+
+// V is a vendor description like the one in Vendor.h
+template<typename V>
 struct BiometricsFingerprint : public IBiometricsFingerprint {
 public:
     BiometricsFingerprint();
 
+    /*
+     * Waits for the vendor HAL in the background. We register ourselves as
+     * the AOSP HAL once it first shows up, and follow it across restarts.
+     * A front-end that wraps us instead passes publish, called at that point
+     * in place of our own registration.
+     * Returns false if the device doesn't declare the vendor HAL at all.
+     */
+    bool start(std::function<void()> publish = nullptr);
+
+    // Called from hwbinder threads
+    void onVendorRegistered();
+    void onVendorDied(uint64_t generation);
+
+    // Touches on an in-display sensor as the framework reports them (AIDL
+    // front-end), the only source then: the vendor's own are ignored
+    void touchDown() { mTouch.touchDown(); }
+    void touchUp() { mTouch.touchUp(); }
+    void uiReady() { mTouch.uiReady(); }
+
     // Methods from ::android::hardware::biometrics::fingerprint::V2_1::IBiometricsFingerprint follow.
     Return<uint64_t> setNotify(const sp<IBiometricsFingerprintClientCallback>& clientCallback) override;
     Return<uint64_t> preEnroll() override;
@@ -62,10 +180,47 @@ public:
     Return<RequestStatus> setActiveGroup(uint32_t gid, const hidl_string& storePath) override;
     Return<RequestStatus> authenticate(uint64_t operationId, uint32_t gid) override;
 
+    // lshal debug: current state and the recent event trace
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) override;
+
 private:
-    sp<vendor::oplus::hardware::biometrics::fingerprint::V2_1::IBiometricsFingerprint> mOplusBiometricsFingerprint;
-    sp<OplusClientCallback> mOplusClientCallback;
-    static Return<RequestStatus> OplusToAOSPRequestStatus(vendor::oplus::hardware::biometrics::fingerprint::V2_1::RequestStatus req);
+    sp<typename V::IBiometricsFingerprint> vendorHal();
+    sp<IBiometricsFingerprintClientCallback> clientCallback();
+    uint32_t activeGroup();
+    void sendEnumerate(const sp<IBiometricsFingerprintClientCallback>& client, uint32_t gid,
+            const std::vector<uint32_t>& fingers);
+    void refreshTemplates(sp<typename V::IBiometricsFingerprint> hal);
+
+    std::mutex mVendorLock;
+    std::condition_variable mVendorCond;
+    sp<typename V::IBiometricsFingerprint> mVendorBiometricsFingerprint;
+    sp<VendorClientCallback<V>> mVendorClientCallback;
+    uint64_t mVendorGeneration = 0;
+    bool mRegistered = false;
+    std::function<void()> mPublish;
+
+    // What the framework told us, replayed into a restarted vendor HAL
+    sp<IBiometricsFingerprintClientCallback> mClientCallback;
+    bool mHaveActiveGroup = false;
+    uint32_t mActiveGroup = 0;
+    hidl_string mStorePath;
+
+    sp<VendorServiceNotification<V>> mServiceNotification;
+    sp<VendorDeathRecipient<V>> mDeathRecipient;
+
+    // Filled by vendor callbacks, used to complete operations ourselves
+    friend class VendorClientCallback<V>;
+    std::chrono::milliseconds mCallbackTimeout;
+    CallbackQueue mCallbacks;
+    TouchNotifier mTouch;
+    PendingOperation mCancel;
+    PendingOperation mEnumerate;
+    // Only one vendor enumerate at a time, ours or the framework's
+    std::mutex mEnumerateLock;
+    // Set while a background refresh runs, its results aren't for the framework
+    std::atomic<bool> mRefreshing{false};
+    std::condition_variable mRefreshDone;
+    TemplateCache mTemplates;
 };
 
 }  // namespace implementation
@@ -0,0 +1,55 @@
+#include "CallbackQueue.h"
+
+#include <algorithm>
+
+namespace android {
+namespace hardware {
+namespace biometrics {
+namespace fingerprint {
+namespace V2_1 {
+namespace implementation {
+
+CallbackQueue::CallbackQueue() : mThread(&CallbackQueue::run, this) {}
+
+CallbackQueue::~CallbackQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStop = true;
+    }
+    mCond.notify_one();
+    mThread.join();
+}
+
+void CallbackQueue::post(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mQueue.push_back(std::move(fn));
+        mMaxDepth = std::max(mMaxDepth, mQueue.size());
+    }
+    mCond.notify_one();
+}
+
+size_t CallbackQueue::maxDepth() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mMaxDepth;
+}
+
+void CallbackQueue::run() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while(true) {
+        mCond.wait(lock, [this] { return mStop || !mQueue.empty(); });
+        if(mQueue.empty()) return;
+        std::function<void()> fn = std::move(mQueue.front());
+        mQueue.pop_front();
+        lock.unlock();
+        fn();
+        lock.lock();
+    }
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace fingerprint
+}  // namespace biometrics
+}  // namespace hardware
+}  // namespace android
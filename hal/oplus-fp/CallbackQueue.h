@@ -0,0 +1,48 @@
+#ifndef ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_CALLBACKQUEUE_H
+#define ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_CALLBACKQUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace android {
+namespace hardware {
+namespace biometrics {
+namespace fingerprint {
+namespace V2_1 {
+namespace implementation {
+
+/*
+ * Callbacks to the framework are sent from a single thread, in the order
+ * the vendor HAL delivered them. The vendor's callback thread only queues
+ * them, so it never waits on the framework. A slow call on one of our
+ * binder threads doesn't hold up callbacks either.
+ */
+class CallbackQueue {
+public:
+    CallbackQueue();
+    ~CallbackQueue();
+    void post(std::function<void()> fn);
+    size_t maxDepth();
+
+private:
+    void run();
+
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::deque<std::function<void()>> mQueue;
+    size_t mMaxDepth = 0;
+    bool mStop = false;
+    std::thread mThread;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace fingerprint
+}  // namespace biometrics
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_CALLBACKQUEUE_H
@@ -0,0 +1,94 @@
+#include "Fingerprint.h"
+#include "Trace.h"
+
+#include <android-base/properties.h>
+#include <stdio.h>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace biometrics {
+namespace fingerprint {
+
+using ::android::hardware::biometrics::fingerprint::V2_1::implementation::verboseLogging;
+
+// The one sensor of config_biometric_sensors, strong
+static constexpr int32_t kSensorId = 0;
+static constexpr int32_t kMaxEnrollmentsPerUser = 5;
+
+Fingerprint::Fingerprint(::android::sp<HidlAdapter> hal) :
+    mHal(hal), mDeathRecipient(AIBinder_DeathRecipient_new(onCallbackDied)) {}
+
+Fingerprint::~Fingerprint() {
+    AIBinder_DeathRecipient_delete(mDeathRecipient);
+}
+
+/*
+ * system_server died, it won't close() its session. Only the current
+ * session matters, an older one was already closed or taken over.
+ */
+void Fingerprint::onCallbackDied(void *cookie) {
+    Fingerprint *self = static_cast<Fingerprint*>(cookie);
+    std::shared_ptr<Session> session;
+    {
+        std::lock_guard<std::mutex> lock(self->mLock);
+        session = self->mSession;
+    }
+    if(session != nullptr && !session->isClosed() && !session->callbackAlive()) {
+        ALOGE("Session client died without closing it");
+        session->abandon();
+    }
+}
+
+/*
+ * 2.1 doesn't describe the sensor. An in-display one needs its position
+ * on the panel, "x,y,radius" in pixels, the rest stay generic.
+ */
+ndk::ScopedAStatus Fingerprint::getSensorProps(std::vector<SensorProps>* out) {
+    SensorProps props;
+    props.commonProps.sensorId = kSensorId;
+    props.commonProps.sensorStrength = common::SensorStrength::STRONG;
+    props.commonProps.maxEnrollmentsPerUser = kMaxEnrollmentsPerUser;
+    props.sensorType = FingerprintSensorType::UNKNOWN;
+    props.supportsNavigationGestures = false;
+    props.supportsDetectInteraction = false;
+
+    SensorLocation location;
+    std::string udfps = ::android::base::GetProperty("persist.sys.phh.fingerprint.udfps_location", "");
+    if(sscanf(udfps.c_str(), "%d,%d,%d", &location.sensorLocationX, &location.sensorLocationY,
+                &location.sensorRadius) == 3) {
+        props.sensorType = FingerprintSensorType::UNDER_DISPLAY_OPTICAL;
+    }
+    props.sensorLocations = { location };
+
+    *out = { props };
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Fingerprint::createSession(int32_t sensorId, int32_t userId,
+        const std::shared_ptr<ISessionCallback>& cb, std::shared_ptr<ISession>* out) {
+    FP_LOG("AIDL createSession %d %d", sensorId, userId);
+    std::lock_guard<std::mutex> lock(mLock);
+    // The adapter has one client callback, so one session at a time
+    if(mSession != nullptr && !mSession->isClosed()) {
+        if(mSession->callbackAlive()) {
+            ALOGE("createSession for user %d while the previous session is open", userId);
+            return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+        }
+        // In case the death notification is still on its way
+        ALOGE("createSession for user %d, taking over from a dead client", userId);
+        mSession->abandon();
+    }
+    mSession = ndk::SharedRefBase::make<Session>(mHal, &mLockout, userId, cb);
+    mSession->open();
+    // The Fingerprint instance lives as long as the service
+    AIBinder_linkToDeath(cb->asBinder().get(), mDeathRecipient, this);
+    *out = mSession;
+    return ndk::ScopedAStatus::ok();
+}
+
+}  // namespace fingerprint
+}  // namespace biometrics
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,48 @@
+#ifndef ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_AIDL_FINGERPRINT_H
+#define ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_AIDL_FINGERPRINT_H
+
+#include <aidl/android/hardware/biometrics/fingerprint/BnFingerprint.h>
+#include <android/binder_ibinder.h>
+#include "Session.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace biometrics {
+namespace fingerprint {
+
+/*
+ * AIDL front-end, built instead of the 2.1 one with FP_FRONTEND_AIDL.
+ * It drives the same adapter in process, so following the vendor HAL,
+ * synthesized callbacks, the template cache and in-display touches all
+ * behave the same, only the framework side of the binder changes.
+ */
+class Fingerprint : public BnFingerprint {
+public:
+    explicit Fingerprint(::android::sp<HidlAdapter> hal);
+    ~Fingerprint() override;
+
+    ndk::ScopedAStatus getSensorProps(std::vector<SensorProps>* out) override;
+    ndk::ScopedAStatus createSession(int32_t sensorId, int32_t userId,
+            const std::shared_ptr<ISessionCallback>& cb, std::shared_ptr<ISession>* out) override;
+
+private:
+    static void onCallbackDied(void *cookie);
+
+    ::android::sp<HidlAdapter> mHal;
+    AIBinder_DeathRecipient *mDeathRecipient;
+    LockoutTracker mLockout;
+    std::mutex mLock;
+    std::shared_ptr<Session> mSession;
+};
+
+}  // namespace fingerprint
+}  // namespace biometrics
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
+
+#endif  // ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_AIDL_FINGERPRINT_H
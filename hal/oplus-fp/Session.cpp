@@ -0,0 +1,493 @@
+#include "Session.h"
+#include "Trace.h"
+
+#include <aidl/android/hardware/biometrics/common/BnCancellationSignal.h>
+#include <android/binder_ibinder.h>
+#include <endian.h>
+#include <errno.h>
+#include <hardware/hw_auth_token.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <thread>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace biometrics {
+namespace fingerprint {
+
+namespace hidlfp = ::android::hardware::biometrics::fingerprint::V2_1;
+using hidlfp::IBiometricsFingerprintClientCallback;
+using hidlfp::implementation::EnumTable;
+using hidlfp::implementation::verboseLogging;
+using ::android::hardware::hidl_array;
+using ::android::hardware::hidl_vec;
+using ::android::hardware::Return;
+using ::android::hardware::Void;
+using ::android::sp;
+
+// What the framework gave 2.1 HALs
+static constexpr uint32_t kEnrollTimeoutSec = 60;
+static constexpr int kTimedLockoutFailures = 5;
+static constexpr int kPermanentLockoutFailures = 20;
+static constexpr int64_t kTimedLockoutMs = 30000;
+
+static constexpr EnumTable<hidlfp::FingerprintAcquiredInfo, AcquiredInfo, 7> kAcquiredInfo = {{
+    { hidlfp::FingerprintAcquiredInfo::ACQUIRED_GOOD, AcquiredInfo::GOOD },
+    { hidlfp::FingerprintAcquiredInfo::ACQUIRED_PARTIAL, AcquiredInfo::PARTIAL },
+    { hidlfp::FingerprintAcquiredInfo::ACQUIRED_INSUFFICIENT, AcquiredInfo::INSUFFICIENT },
+    { hidlfp::FingerprintAcquiredInfo::ACQUIRED_IMAGER_DIRTY, AcquiredInfo::SENSOR_DIRTY },
+    { hidlfp::FingerprintAcquiredInfo::ACQUIRED_TOO_SLOW, AcquiredInfo::TOO_SLOW },
+    { hidlfp::FingerprintAcquiredInfo::ACQUIRED_TOO_FAST, AcquiredInfo::TOO_FAST },
+    { hidlfp::FingerprintAcquiredInfo::ACQUIRED_VENDOR, AcquiredInfo::VENDOR },
+}, AcquiredInfo::UNKNOWN };
+
+// ERROR_LOCKOUT has no AIDL error, it becomes onLockoutTimed
+static constexpr EnumTable<hidlfp::FingerprintError, Error, 7> kError = {{
+    { hidlfp::FingerprintError::ERROR_HW_UNAVAILABLE, Error::HW_UNAVAILABLE },
+    { hidlfp::FingerprintError::ERROR_UNABLE_TO_PROCESS, Error::UNABLE_TO_PROCESS },
+    { hidlfp::FingerprintError::ERROR_TIMEOUT, Error::TIMEOUT },
+    { hidlfp::FingerprintError::ERROR_NO_SPACE, Error::NO_SPACE },
+    { hidlfp::FingerprintError::ERROR_CANCELED, Error::CANCELED },
+    { hidlfp::FingerprintError::ERROR_UNABLE_TO_REMOVE, Error::UNABLE_TO_REMOVE },
+    { hidlfp::FingerprintError::ERROR_VENDOR, Error::VENDOR },
+}, Error::UNKNOWN };
+
+static_assert(sizeof(hw_auth_token_t) == 69, "hw_auth_token_t is what 2.1 HALs exchange");
+
+// hw_auth_token_t keeps authenticator_type and timestamp in network order
+static hidl_array<uint8_t, 69> toHidlToken(const HardwareAuthToken& hat) {
+    hw_auth_token_t token = {};
+    token.version = HW_AUTH_TOKEN_VERSION;
+    token.challenge = hat.challenge;
+    token.user_id = hat.userId;
+    token.authenticator_id = hat.authenticatorId;
+    token.authenticator_type = htobe32((uint32_t)hat.authenticatorType);
+    token.timestamp = htobe64(hat.timestamp.milliSeconds);
+    memcpy(token.hmac, hat.mac.data(), std::min(hat.mac.size(), sizeof(token.hmac)));
+
+    hidl_array<uint8_t, 69> out;
+    memcpy(out.data(), &token, sizeof(token));
+    return out;
+}
+
+static HardwareAuthToken fromHidlToken(const hidl_vec<uint8_t>& data) {
+    HardwareAuthToken hat;
+    if(data.size() != sizeof(hw_auth_token_t)) return hat;
+    hw_auth_token_t token;
+    memcpy(&token, data.data(), sizeof(token));
+    hat.challenge = token.challenge;
+    hat.userId = token.user_id;
+    hat.authenticatorId = token.authenticator_id;
+    hat.authenticatorType = (keymaster::HardwareAuthenticatorType)be32toh(token.authenticator_type);
+    hat.timestamp.milliSeconds = be64toh(token.timestamp);
+    hat.mac.assign(token.hmac, token.hmac + sizeof(token.hmac));
+    return hat;
+}
+
+static int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+LockoutTracker::Mode LockoutTracker::mode(int32_t userId, int64_t *timedMs) {
+    std::lock_guard<std::mutex> lock(mLock);
+    User& user = mUsers[userId];
+    if(user.permanentFailures >= kPermanentLockoutFailures) return Mode::Permanent;
+    int64_t left = user.lockedUntilMs - nowMs();
+    if(left <= 0) return Mode::None;
+    *timedMs = left;
+    return Mode::Timed;
+}
+
+LockoutTracker::Mode LockoutTracker::failed(int32_t userId) {
+    std::lock_guard<std::mutex> lock(mLock);
+    User& user = mUsers[userId];
+    if(++user.permanentFailures >= kPermanentLockoutFailures) return Mode::Permanent;
+    if(++user.timedFailures < kTimedLockoutFailures) return Mode::None;
+    user.timedFailures = 0;
+    user.lockedUntilMs = nowMs() + kTimedLockoutMs;
+    return Mode::Timed;
+}
+
+void LockoutTracker::succeeded(int32_t userId) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mUsers[userId].timedFailures = 0;
+}
+
+void LockoutTracker::reset(int32_t userId) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mUsers[userId] = User();
+}
+
+/*
+ * What the adapter sees as the framework's 2.1 callback. Turns the 2.1
+ * callbacks into the AIDL ones, which report enumerate and remove as one
+ * list. Called in order from the adapter's callback queue.
+ */
+class SessionCallback : public IBiometricsFingerprintClientCallback {
+public:
+    enum class Op { None, Enroll, Authenticate, Enumerate, Remove };
+
+    SessionCallback(sp<HidlAdapter> hal, LockoutTracker *lockout, int32_t userId,
+            std::shared_ptr<ISessionCallback> cb) :
+        mHal(hal), mLockout(lockout), mUserId(userId), mCb(cb) {}
+
+    void begin(Op op) {
+        std::lock_guard<std::mutex> lock(mLock);
+        mOp = op;
+        mEnumerated.clear();
+    }
+
+    // Returns the first one to remove, or 0 if there is nothing to do
+    int32_t beginRemove(const std::vector<int32_t>& enrollmentIds) {
+        std::lock_guard<std::mutex> lock(mLock);
+        mOp = Op::Remove;
+        mToRemove.assign(enrollmentIds.rbegin(), enrollmentIds.rend());
+        mRemoved.clear();
+        return nextToRemove();
+    }
+
+    Return<void> onEnrollResult(uint64_t deviceId, uint32_t fingerId, uint32_t groupId,
+            uint32_t remaining) override {
+        if(remaining == 0) begin(Op::None);
+        mCb->onEnrollmentProgress(fingerId, remaining);
+        return Void();
+    }
+
+    Return<void> onAcquired(uint64_t deviceId, hidlfp::FingerprintAcquiredInfo acquiredInfo,
+            int32_t vendorCode) override {
+        mCb->onAcquired(kAcquiredInfo(acquiredInfo), vendorCode);
+        return Void();
+    }
+
+    Return<void> onAuthenticated(uint64_t deviceId, uint32_t fingerId, uint32_t groupId,
+            const hidl_vec<uint8_t>& token) override {
+        if(fingerId != 0) {
+            begin(Op::None);
+            mLockout->succeeded(mUserId);
+            mCb->onAuthenticationSucceeded(fingerId, fromHidlToken(token));
+            return Void();
+        }
+        mCb->onAuthenticationFailed();
+        LockoutTracker::Mode mode = mLockout->failed(mUserId);
+        if(mode == LockoutTracker::Mode::None) return Void();
+        // 2.1 HALs keep authenticating after a failure, stop it without telling the framework
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mOp = Op::None;
+            mDropCancel = true;
+        }
+        if(mode == LockoutTracker::Mode::Timed)
+            mCb->onLockoutTimed(kTimedLockoutMs);
+        else
+            mCb->onLockoutPermanent();
+        sp<HidlAdapter> hal = mHal;
+        std::thread([hal] { hal->cancel(); }).detach();
+        return Void();
+    }
+
+    Return<void> onError(uint64_t deviceId, hidlfp::FingerprintError error, int32_t vendorCode) override {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            if(error == hidlfp::FingerprintError::ERROR_CANCELED && mDropCancel) {
+                mDropCancel = false;
+                return Void();
+            }
+            mOp = Op::None;
+        }
+        if(error == hidlfp::FingerprintError::ERROR_LOCKOUT) {
+            mCb->onLockoutTimed(kTimedLockoutMs);
+            return Void();
+        }
+        mCb->onError(kError(error), vendorCode);
+        return Void();
+    }
+
+    Return<void> onRemoved(uint64_t deviceId, uint32_t fingerId, uint32_t groupId,
+            uint32_t remaining) override {
+        int32_t next;
+        std::vector<int32_t> removed;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            if(mOp != Op::Remove) return Void();
+            if(fingerId != 0) mRemoved.push_back(fingerId);
+            if(remaining != 0) return Void();
+            next = nextToRemove();
+            if(next == 0) {
+                mOp = Op::None;
+                removed.swap(mRemoved);
+            }
+        }
+        // 2.1 removes one template per call, chain them
+        if(next != 0) {
+            if(mHal->remove(mUserId, next) != hidlfp::RequestStatus::SYS_OK) {
+                begin(Op::None);
+                mCb->onError(Error::UNABLE_TO_REMOVE, 0);
+            }
+            return Void();
+        }
+        mCb->onEnrollmentsRemoved(removed);
+        return Void();
+    }
+
+    Return<void> onEnumerate(uint64_t deviceId, uint32_t fingerId, uint32_t groupId,
+            uint32_t remaining) override {
+        std::vector<int32_t> enrollments;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            // fid 0 is how an empty group is reported
+            if(fingerId != 0) mEnumerated.push_back(fingerId);
+            if(remaining != 0) return Void();
+            enrollments.swap(mEnumerated);
+            if(mOp == Op::Enumerate) mOp = Op::None;
+        }
+        mCb->onEnrollmentsEnumerated(enrollments);
+        return Void();
+    }
+
+private:
+    // Called with mLock held
+    int32_t nextToRemove() {
+        if(mToRemove.empty()) return 0;
+        int32_t next = mToRemove.back();
+        mToRemove.pop_back();
+        return next;
+    }
+
+    sp<HidlAdapter> mHal;
+    LockoutTracker *mLockout;
+    int32_t mUserId;
+    std::shared_ptr<ISessionCallback> mCb;
+
+    std::mutex mLock;
+    Op mOp = Op::None;
+    bool mDropCancel = false;
+    std::vector<int32_t> mEnumerated;
+    std::vector<int32_t> mToRemove;
+    std::vector<int32_t> mRemoved;
+};
+
+class CancellationSignal : public common::BnCancellationSignal {
+public:
+    CancellationSignal(std::weak_ptr<Session> session, std::function<void(Session&)> cancel) :
+        mSession(session), mCancel(cancel) {}
+
+    ndk::ScopedAStatus cancel() override {
+        if(auto session = mSession.lock()) mCancel(*session);
+        return ndk::ScopedAStatus::ok();
+    }
+
+private:
+    std::weak_ptr<Session> mSession;
+    std::function<void(Session&)> mCancel;
+};
+
+Session::Session(sp<HidlAdapter> hal, LockoutTracker *lockout, int32_t userId,
+        std::shared_ptr<ISessionCallback> cb) :
+    mHal(hal), mLockout(lockout), mUserId(userId), mCb(cb) {
+    mCallback = new SessionCallback(hal, lockout, userId, cb);
+}
+
+Session::~Session() {}
+
+void Session::open() {
+    post([this] {
+        mHal->setNotify(mCallback);
+        // Where the framework put 2.1 HALs' templates. It created the directory for them
+        std::string storePath = "/data/vendor_de/" + std::to_string(mUserId) + "/fpdata";
+        if(mkdir(storePath.c_str(), 0700) != 0 && errno != EEXIST)
+            ALOGE("Could not create %s: %s", storePath.c_str(), strerror(errno));
+        if(mHal->setActiveGroup(mUserId, storePath) != hidlfp::RequestStatus::SYS_OK)
+            ALOGE("setActiveGroup %d failed", mUserId);
+    });
+}
+
+bool Session::isClosed() {
+    return mClosed;
+}
+
+bool Session::callbackAlive() {
+    return AIBinder_isAlive(mCb->asBinder().get());
+}
+
+void Session::post(std::function<void()> fn) {
+    mWorker.post([this, fn] {
+        if(!mAbandoned) fn();
+    });
+}
+
+void Session::abandon() {
+    mAbandoned = true;
+    mClosed = true;
+    std::promise<void> idle;
+    mWorker.post([this, &idle] {
+        // Whatever the dead client started would keep the sensor armed
+        mHal->cancel();
+        idle.set_value();
+    });
+    idle.get_future().wait();
+}
+
+std::shared_ptr<common::ICancellationSignal> Session::cancellationSignal() {
+    return ndk::SharedRefBase::make<CancellationSignal>(ref<Session>(), [](Session& session) {
+        session.post([&session] { session.mHal->cancel(); });
+    });
+}
+
+ndk::ScopedAStatus Session::generateChallenge() {
+    FP_LOG("AIDL generateChallenge");
+    post([this] {
+        uint64_t challenge = mHal->preEnroll();
+        mCb->onChallengeGenerated(challenge);
+    });
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Session::revokeChallenge(int64_t challenge) {
+    FP_LOG("AIDL revokeChallenge");
+    post([this, challenge] {
+        mHal->postEnroll();
+        mCb->onChallengeRevoked(challenge);
+    });
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Session::enroll(const HardwareAuthToken& hat,
+        std::shared_ptr<common::ICancellationSignal>* out) {
+    FP_LOG("AIDL enroll");
+    *out = cancellationSignal();
+    hidl_array<uint8_t, 69> token = toHidlToken(hat);
+    post([this, token] {
+        mCallback->begin(SessionCallback::Op::Enroll);
+        if(mHal->enroll(token, mUserId, kEnrollTimeoutSec) != hidlfp::RequestStatus::SYS_OK) {
+            mCallback->begin(SessionCallback::Op::None);
+            mCb->onError(Error::UNABLE_TO_PROCESS, 0);
+        }
+    });
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Session::authenticate(int64_t operationId,
+        std::shared_ptr<common::ICancellationSignal>* out) {
+    FP_LOG("AIDL authenticate");
+    *out = cancellationSignal();
+    post([this, operationId] {
+        int64_t timedMs = 0;
+        switch(mLockout->mode(mUserId, &timedMs)) {
+            case LockoutTracker::Mode::Timed:
+                mCb->onLockoutTimed(timedMs);
+                return;
+            case LockoutTracker::Mode::Permanent:
+                mCb->onLockoutPermanent();
+                return;
+            case LockoutTracker::Mode::None:
+                break;
+        }
+        mCallback->begin(SessionCallback::Op::Authenticate);
+        if(mHal->authenticate(operationId, mUserId) != hidlfp::RequestStatus::SYS_OK) {
+            mCallback->begin(SessionCallback::Op::None);
+            mCb->onError(Error::UNABLE_TO_PROCESS, 0);
+        }
+    });
+    return ndk::ScopedAStatus::ok();
+}
+
+// Not in 2.1, and getSensorProps says so
+ndk::ScopedAStatus Session::detectInteraction(std::shared_ptr<common::ICancellationSignal>* out) {
+    FP_LOG("AIDL detectInteraction");
+    *out = cancellationSignal();
+    post([this] { mCb->onError(Error::UNABLE_TO_PROCESS, 0); });
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Session::enumerateEnrollments() {
+    FP_LOG("AIDL enumerateEnrollments");
+    post([this] {
+        mCallback->begin(SessionCallback::Op::Enumerate);
+        if(mHal->enumerate() != hidlfp::RequestStatus::SYS_OK) {
+            mCallback->begin(SessionCallback::Op::None);
+            mCb->onError(Error::UNABLE_TO_PROCESS, 0);
+        }
+    });
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Session::removeEnrollments(const std::vector<int32_t>& enrollmentIds) {
+    FP_LOG("AIDL removeEnrollments %zu", enrollmentIds.size());
+    post([this, enrollmentIds] {
+        int32_t first = mCallback->beginRemove(enrollmentIds);
+        if(first == 0) {
+            mCallback->begin(SessionCallback::Op::None);
+            mCb->onEnrollmentsRemoved({});
+            return;
+        }
+        if(mHal->remove(mUserId, first) != hidlfp::RequestStatus::SYS_OK) {
+            mCallback->begin(SessionCallback::Op::None);
+            mCb->onError(Error::UNABLE_TO_REMOVE, 0);
+        }
+    });
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Session::getAuthenticatorId() {
+    post([this] {
+        uint64_t id = mHal->getAuthenticatorId();
+        mCb->onAuthenticatorIdRetrieved(id);
+    });
+    return ndk::ScopedAStatus::ok();
+}
+
+// 2.1 HALs change it on their own when templates change, all we can do is report it
+ndk::ScopedAStatus Session::invalidateAuthenticatorId() {
+    post([this] {
+        uint64_t id = mHal->getAuthenticatorId();
+        mCb->onAuthenticatorIdInvalidated(id);
+    });
+    return ndk::ScopedAStatus::ok();
+}
+
+// The token comes from the framework's own strong auth, nothing in 2.1 could verify it
+ndk::ScopedAStatus Session::resetLockout(const HardwareAuthToken& hat) {
+    FP_LOG("AIDL resetLockout");
+    post([this] {
+        mLockout->reset(mUserId);
+        mCb->onLockoutCleared();
+    });
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Session::close() {
+    FP_LOG("AIDL close");
+    post([this] {
+        mClosed = true;
+        mCb->onSessionClosed();
+    });
+    return ndk::ScopedAStatus::ok();
+}
+
+// The touch path skips the worker, it is what the in-display sensor waits on
+ndk::ScopedAStatus Session::onPointerDown(int32_t pointerId, int32_t x, int32_t y, float minor, float major) {
+    mHal->touchDown();
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Session::onPointerUp(int32_t pointerId) {
+    mHal->touchUp();
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Session::onUiReady() {
+    mHal->uiReady();
+    return ndk::ScopedAStatus::ok();
+}
+
+}  // namespace fingerprint
+}  // namespace biometrics
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
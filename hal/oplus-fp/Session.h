@@ -0,0 +1,115 @@
+#ifndef ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_AIDL_SESSION_H
+#define ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_AIDL_SESSION_H
+
+#include <aidl/android/hardware/biometrics/fingerprint/BnSession.h>
+#include <aidl/android/hardware/biometrics/fingerprint/ISessionCallback.h>
+#include "BiometricsFingerprint.h"
+#include "CallbackQueue.h"
+#include "Vendor.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace biometrics {
+namespace fingerprint {
+
+using HidlAdapter = ::android::hardware::biometrics::fingerprint::V2_1::implementation::BiometricsFingerprint<
+        ::android::hardware::biometrics::fingerprint::V2_1::implementation::Vendor>;
+using ::android::hardware::biometrics::fingerprint::V2_1::implementation::CallbackQueue;
+using ::aidl::android::hardware::keymaster::HardwareAuthToken;
+
+/*
+ * The 2.1 interface leaves lockout to the framework, AIDL HALs own it.
+ * Same policy as the framework applied to 2.1 HALs: 5 failures lock
+ * authentication for 30s, 20 lock it until a strong auth resets it.
+ */
+class LockoutTracker {
+public:
+    enum class Mode { None, Timed, Permanent };
+
+    // Milliseconds left in *timedMs when Timed
+    Mode mode(int32_t userId, int64_t *timedMs);
+    // Returns the mode this failure put the user in
+    Mode failed(int32_t userId);
+    void succeeded(int32_t userId);
+    void reset(int32_t userId);
+
+private:
+    struct User {
+        int timedFailures = 0;
+        int permanentFailures = 0;
+        int64_t lockedUntilMs = 0;
+    };
+    std::mutex mLock;
+    std::map<int32_t, User> mUsers;
+};
+
+class SessionCallback;
+
+/*
+ * One framework session for one user. Every request is translated into
+ * 2.1 calls on the adapter, which runs them against the vendor HAL. The
+ * adapter may block (vendor HAL restarting, cancel confirmation), so
+ * requests run in order on a worker instead of the binder thread.
+ */
+class Session : public BnSession {
+public:
+    Session(::android::sp<HidlAdapter> hal, LockoutTracker *lockout, int32_t userId,
+            std::shared_ptr<ISessionCallback> cb);
+    ~Session() override;
+
+    // Points the adapter at this session, before it is handed out
+    void open();
+    bool isClosed();
+    bool callbackAlive();
+    /*
+     * The client died without close(): cancels what runs on the vendor
+     * HAL, drops what is still queued, and never calls back. Returns once
+     * the worker is idle, so a new session can take the adapter over.
+     */
+    void abandon();
+
+    ndk::ScopedAStatus generateChallenge() override;
+    ndk::ScopedAStatus revokeChallenge(int64_t challenge) override;
+    ndk::ScopedAStatus enroll(const HardwareAuthToken& hat,
+            std::shared_ptr<common::ICancellationSignal>* out) override;
+    ndk::ScopedAStatus authenticate(int64_t operationId,
+            std::shared_ptr<common::ICancellationSignal>* out) override;
+    ndk::ScopedAStatus detectInteraction(std::shared_ptr<common::ICancellationSignal>* out) override;
+    ndk::ScopedAStatus enumerateEnrollments() override;
+    ndk::ScopedAStatus removeEnrollments(const std::vector<int32_t>& enrollmentIds) override;
+    ndk::ScopedAStatus getAuthenticatorId() override;
+    ndk::ScopedAStatus invalidateAuthenticatorId() override;
+    ndk::ScopedAStatus resetLockout(const HardwareAuthToken& hat) override;
+    ndk::ScopedAStatus close() override;
+    ndk::ScopedAStatus onPointerDown(int32_t pointerId, int32_t x, int32_t y, float minor, float major) override;
+    ndk::ScopedAStatus onPointerUp(int32_t pointerId) override;
+    ndk::ScopedAStatus onUiReady() override;
+
+private:
+    std::shared_ptr<common::ICancellationSignal> cancellationSignal();
+    // Runs fn on the worker, unless the session was abandoned by then
+    void post(std::function<void()> fn);
+
+    ::android::sp<HidlAdapter> mHal;
+    LockoutTracker *mLockout;
+    int32_t mUserId;
+    std::shared_ptr<ISessionCallback> mCb;
+    ::android::sp<SessionCallback> mCallback;
+    std::atomic<bool> mClosed{false};
+    std::atomic<bool> mAbandoned{false};
+    CallbackQueue mWorker;
+};
+
+}  // namespace fingerprint
+}  // namespace biometrics
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
+
+#endif  // ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_AIDL_SESSION_H
@@ -0,0 +1,84 @@
+#include "TouchNotifier.h"
+#include "Trace.h"
+
+#include <android-base/properties.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/system_properties.h>
+#include <unistd.h>
+#include <string>
+
+namespace android {
+namespace hardware {
+namespace biometrics {
+namespace fingerprint {
+namespace V2_1 {
+namespace implementation {
+
+static const char *kTouchProp = "vendor.phh.fingerprint.touch";
+
+static const char *const kPanelNodes[] = {
+    "/sys/kernel/oplus_display/notify_fppress",
+    "/sys/kernel/oppo_display/notify_fppress",
+};
+
+TouchNotifier::TouchNotifier() {
+    std::string node = android::base::GetProperty("persist.sys.phh.fingerprint.touch_node", "");
+    if(node == "none") return;
+    if(!node.empty()) {
+        mPanelFd = open(node.c_str(), O_WRONLY | O_CLOEXEC);
+    } else {
+        for(auto path: kPanelNodes) {
+            mPanelFd = open(path, O_WRONLY | O_CLOEXEC);
+            if(mPanelFd != -1) {
+                node = path;
+                break;
+            }
+        }
+    }
+    if(mPanelFd != -1)
+        ALOGI("Forwarding fingerprint touches to %s", node.c_str());
+}
+
+TouchNotifier::~TouchNotifier() {
+    if(mPanelFd != -1) close(mPanelFd);
+}
+
+void TouchNotifier::notify(TraceEvent event, const char *name, const char *panelValue) {
+    uint64_t received = monotonicNs();
+    uint64_t written = 0;
+    if(mPanelFd != -1 && panelValue != nullptr) {
+        if(pwrite(mPanelFd, panelValue, 1, 0) == 1)
+            written = monotonicNs();
+        else
+            ALOGW("Failed writing panel touch node: %s", strerror(errno));
+    }
+    trace(event, written ? written - received : -1);
+
+    char value[PROP_VALUE_MAX];
+    snprintf(value, sizeof(value), "%s %" PRIu64 " %" PRIu64, name, received, written);
+    std::string v(value);
+    mPublisher.post([v] { android::base::SetProperty(kTouchProp, v); });
+}
+
+void TouchNotifier::touchDown() {
+    notify(TraceEvent::TouchDown, "down", "1");
+}
+
+void TouchNotifier::touchUp() {
+    notify(TraceEvent::TouchUp, "up", "0");
+}
+
+void TouchNotifier::uiReady() {
+    notify(TraceEvent::UIReady, "ui_ready", nullptr);
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace fingerprint
+}  // namespace biometrics
+}  // namespace hardware
+}  // namespace android
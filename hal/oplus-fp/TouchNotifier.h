@@ -0,0 +1,47 @@
+#ifndef ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_TOUCHNOTIFIER_H
+#define ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_TOUCHNOTIFIER_H
+
+#include "CallbackQueue.h"
+#include "Trace.h"
+
+namespace android {
+namespace hardware {
+namespace biometrics {
+namespace fingerprint {
+namespace V2_1 {
+namespace implementation {
+
+/*
+ * Relays the in-display sensor's finger down/up, which the vendor HAL
+ * reports well before the first onAcquired:
+ * - to the panel driver, which raises HBM, by writing 1/0 to its
+ *   notify_fppress node (or persist.sys.phh.fingerprint.touch_node), when
+ *   the vendor policy leaves it writable to us
+ * - to SystemUI through vendor.phh.fingerprint.touch, which is set to
+ *   "<down|up|ui_ready> <received_ns> <panel_ns>". Both are
+ *   CLOCK_MONOTONIC like System.nanoTime(). panel_ns is 0 without a panel node.
+ */
+class TouchNotifier {
+public:
+    TouchNotifier();
+    ~TouchNotifier();
+    void touchDown();
+    void touchUp();
+    void uiReady();
+
+private:
+    void notify(TraceEvent event, const char *name, const char *panelValue);
+
+    int mPanelFd = -1;
+    // Property sets go through init, keep them off the vendor callback thread
+    CallbackQueue mPublisher;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace fingerprint
+}  // namespace biometrics
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_TOUCHNOTIFIER_H
@@ -0,0 +1,134 @@
+#include "Trace.h"
+
+#include <android-base/properties.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/system_properties.h>
+#include <time.h>
+#include <atomic>
+
+namespace android {
+namespace hardware {
+namespace biometrics {
+namespace fingerprint {
+namespace V2_1 {
+namespace implementation {
+
+static const char *kVerboseProp = "persist.sys.phh.fingerprint.verbose";
+
+static std::atomic<const prop_info*> gVerboseInfo{nullptr};
+static std::atomic<uint32_t> gVerboseSerial{~0u};
+static std::atomic<uint32_t> gAreaSerial{0};
+static std::atomic<bool> gVerbose{false};
+
+bool verboseLogging() {
+    const prop_info *pi = gVerboseInfo.load(std::memory_order_relaxed);
+    if(pi == nullptr) {
+        // Not set yet, only look again once any property changed
+        uint32_t area = __system_property_area_serial();
+        if(area == gAreaSerial.load(std::memory_order_relaxed)) return false;
+        gAreaSerial.store(area, std::memory_order_relaxed);
+        pi = __system_property_find(kVerboseProp);
+        if(pi == nullptr) return false;
+        gVerboseInfo.store(pi, std::memory_order_relaxed);
+    }
+    uint32_t serial = __system_property_serial(pi);
+    if(serial != gVerboseSerial.load(std::memory_order_relaxed)) {
+        gVerbose.store(android::base::GetBoolProperty(kVerboseProp, false), std::memory_order_relaxed);
+        gVerboseSerial.store(serial, std::memory_order_relaxed);
+    }
+    return gVerbose.load(std::memory_order_relaxed);
+}
+
+static const char *const kEventNames[] = {
+    "vendor-registered",
+    "vendor-died",
+    "setNotify",
+    "preEnroll",
+    "enroll",
+    "postEnroll",
+    "getAuthenticatorId",
+    "cancel",
+    "enumerate",
+    "remove",
+    "setActiveGroup",
+    "authenticate",
+    "onEnrollResult",
+    "onAcquired",
+    "onAuthenticated",
+    "onError",
+    "onRemoved",
+    "onEnumerate",
+    "onSyncTemplates",
+    "synthetic-cancel",
+    "synthetic-enumerate",
+    "cached-enumerate",
+    "dropped-late",
+    "touch-down",
+    "touch-up",
+    "ui-ready",
+};
+static_assert(sizeof(kEventNames) / sizeof(kEventNames[0]) == (size_t)TraceEvent::Count,
+        "Every trace event needs a name");
+
+/*
+ * Seqlock per slot: seq is 2n+1 while entry n is written and 2n+2 once it
+ * is complete, so the dump skips slots that are being rewritten.
+ */
+struct TraceSlot {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<uint64_t> ts_ns{0};
+    std::atomic<uint16_t> event{0};
+    std::atomic<int64_t> args[3];
+};
+
+static constexpr size_t kTraceSize = 512;
+static TraceSlot gTrace[kTraceSize];
+static std::atomic<uint64_t> gTraceHead{0};
+
+uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace(TraceEvent event, int64_t a, int64_t b, int64_t c) {
+    uint64_t n = gTraceHead.fetch_add(1, std::memory_order_relaxed);
+    TraceSlot& slot = gTrace[n % kTraceSize];
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.ts_ns.store(monotonicNs(), std::memory_order_relaxed);
+    slot.event.store((uint16_t)event, std::memory_order_relaxed);
+    slot.args[0].store(a, std::memory_order_relaxed);
+    slot.args[1].store(b, std::memory_order_relaxed);
+    slot.args[2].store(c, std::memory_order_relaxed);
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+}
+
+void dumpTrace(int fd) {
+    uint64_t head = gTraceHead.load(std::memory_order_acquire);
+    uint64_t first = head > kTraceSize ? head - kTraceSize : 0;
+    dprintf(fd, "Trace, %" PRIu64 " events, last %" PRIu64 " (CLOCK_MONOTONIC):\n", head, head - first);
+    for(uint64_t n = first; n < head; n++) {
+        TraceSlot& slot = gTrace[n % kTraceSize];
+        uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if(seq != 2 * n + 2) continue;
+        uint64_t ts = slot.ts_ns.load(std::memory_order_relaxed);
+        uint16_t event = slot.event.load(std::memory_order_relaxed);
+        int64_t a = slot.args[0].load(std::memory_order_relaxed);
+        int64_t b = slot.args[1].load(std::memory_order_relaxed);
+        int64_t c = slot.args[2].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(slot.seq.load(std::memory_order_relaxed) != seq) continue;
+        if(event >= (uint16_t)TraceEvent::Count) continue;
+        dprintf(fd, "%5" PRIu64 ".%06" PRIu64 " %-20s %" PRId64 " %" PRId64 " %" PRId64 "\n",
+                (uint64_t)(ts / 1000000000), (uint64_t)(ts / 1000 % 1000000), kEventNames[event], a, b, c);
+    }
+}
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace fingerprint
+}  // namespace biometrics
+}  // namespace hardware
+}  // namespace android
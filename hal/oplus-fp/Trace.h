@@ -0,0 +1,72 @@
+#ifndef ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_TRACE_H
+#define ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_TRACE_H
+
+#include <log/log.h>
+#include <stdint.h>
+
+namespace android {
+namespace hardware {
+namespace biometrics {
+namespace fingerprint {
+namespace V2_1 {
+namespace implementation {
+
+/*
+ * Every request and callback goes through here, including the whole unlock
+ * path, so nothing is sent to logd unless persist.sys.phh.fingerprint.verbose
+ * is set. The property is only re-read when it changes.
+ */
+bool verboseLogging();
+
+#define FP_LOG(...) do { if(verboseLogging()) ALOGD(__VA_ARGS__); } while(0)
+
+enum class TraceEvent : uint16_t {
+    VendorRegistered,
+    VendorDied,
+    SetNotify,
+    PreEnroll,
+    Enroll,
+    PostEnroll,
+    GetAuthenticatorId,
+    Cancel,
+    Enumerate,
+    Remove,
+    SetActiveGroup,
+    Authenticate,
+    OnEnrollResult,
+    OnAcquired,
+    OnAuthenticated,
+    OnError,
+    OnRemoved,
+    OnEnumerate,
+    OnSyncTemplates,
+    SyntheticCancel,
+    SyntheticEnumerate,
+    CachedEnumerate,
+    DroppedLate,
+    TouchDown,
+    TouchUp,
+    UIReady,
+    Count,
+};
+
+/*
+ * Records an event in a fixed in-memory ring, oldest entries get
+ * overwritten. Writers never block each other, "lshal debug" reads it.
+ */
+void trace(TraceEvent event, int64_t a = 0, int64_t b = 0, int64_t c = 0);
+
+// Prints the ring to fd, oldest first
+void dumpTrace(int fd);
+
+// CLOCK_MONOTONIC, the trace clock
+uint64_t monotonicNs();
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace fingerprint
+}  // namespace biometrics
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_TRACE_H
@@ -0,0 +1,42 @@
+#ifndef ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_VENDOR_H
+#define ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_VENDOR_H
+
+/*
+ * Every binary built from this directory wraps exactly one vendor HAL,
+ * picked with a -DFP_VENDOR_* cflag in Android.bp. The vendor interfaces
+ * are copies of AOSP's 2.1 HAL in another package, so to support another
+ * OEM add a block here and a cc_binary using it.
+ */
+#if defined(FP_VENDOR_OPLUS)
+#include <vendor/oplus/hardware/biometrics/fingerprint/2.1/IBiometricsFingerprint.h>
+namespace vendor_fp = ::vendor::oplus::hardware::biometrics::fingerprint::V2_1;
+#elif defined(FP_VENDOR_OPPO)
+#include <vendor/oppo/hardware/biometrics/fingerprint/2.1/IBiometricsFingerprint.h>
+namespace vendor_fp = ::vendor::oppo::hardware::biometrics::fingerprint::V2_1;
+#else
+#error "No fingerprint vendor selected, define FP_VENDOR_OPLUS or FP_VENDOR_OPPO"
+#endif
+
+namespace android {
+namespace hardware {
+namespace biometrics {
+namespace fingerprint {
+namespace V2_1 {
+namespace implementation {
+
+struct Vendor {
+    using IBiometricsFingerprint = vendor_fp::IBiometricsFingerprint;
+    using IBiometricsFingerprintClientCallback = vendor_fp::IBiometricsFingerprintClientCallback;
+    using RequestStatus = vendor_fp::RequestStatus;
+    using FingerprintError = vendor_fp::FingerprintError;
+    using FingerprintAcquiredInfo = vendor_fp::FingerprintAcquiredInfo;
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace fingerprint
+}  // namespace biometrics
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_BIOMETRICS_FINGERPRINT_V2_1_VENDOR_H
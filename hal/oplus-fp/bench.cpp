@@ -0,0 +1,338 @@
+/*
+ * Drives the fingerprint adapter without fingerprint hardware. This process
+ * is both ends of it:
+ *
+ *   client --(AOSP HAL)--> adapter --(vendor HAL)--> stand-in
+ *     ^------- callbacks ------'  ^------- callbacks -----'
+ *
+ * The stand-in registers as the "default" vendor HAL instance and replays
+ * scripted callbacks, the client measures what comes out of the adapter.
+ * Both live here so their timestamps compare directly.
+ *
+ * Needs the vendor HAL declared in the VINTF manifest, like on the real
+ * device, and the framework stopped ("stop"), which would otherwise grab
+ * the adapter's callback back. Without the vendor HAL, the adapter gives up
+ * at start. On such a device, install the declaration and restart the adapter:
+ *
+ *   m fingerprint-compat-bench fingerprint-compat-bench-vintf
+ *   adb root && adb remount
+ *   adb push $OUT/system/bin/fingerprint-compat-bench /system/bin/
+ *   adb push $OUT/system/etc/vintf/manifest/fingerprint-compat-bench.xml \
+ *       /system/etc/vintf/manifest/
+ *   adb reboot
+ *
+ * or add both modules to PRODUCT_PACKAGES. Don't do this on a device whose
+ * vendor manifest already declares the HAL.
+ */
+
+#include <hidl/HidlTransportSupport.h>
+#include <android/hardware/biometrics/fingerprint/2.1/IBiometricsFingerprint.h>
+#include "Vendor.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace aosp = ::android::hardware::biometrics::fingerprint::V2_1;
+using ::android::hardware::biometrics::fingerprint::V2_1::implementation::Vendor;
+using ::android::hardware::Return;
+using ::android::hardware::Void;
+using ::android::hardware::hidl_array;
+using ::android::hardware::hidl_string;
+using ::android::hardware::hidl_vec;
+using ::android::sp;
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleepMs(int ms) {
+    if(ms > 0) std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+enum class CancelMode { Ok, Missing, Late, Duplicate };
+
+static const char *cancelModeName(CancelMode mode) {
+    switch(mode) {
+        case CancelMode::Ok: return "ok";
+        case CancelMode::Missing: return "missing";
+        case CancelMode::Late: return "late";
+        case CancelMode::Duplicate: return "duplicate";
+    }
+    return "?";
+}
+
+// What the vendor HAL does, tweakable between runs
+struct Script {
+    int matchDelayMs = 0;
+    int acquiredBeforeMatch = 2;
+    CancelMode cancel = CancelMode::Ok;
+    int lateCancelMs = 300;
+};
+
+struct StandIn : public Vendor::IBiometricsFingerprint {
+    Script script;
+    // Set right before each onAuthenticated goes out
+    std::atomic<uint64_t> lastMatchNs{0};
+
+    sp<Vendor::IBiometricsFingerprintClientCallback> callback() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mCallback;
+    }
+
+    // Vendor HALs call back from their own threads, never from the binder call
+    void later(int delayMs, std::function<void(sp<Vendor::IBiometricsFingerprintClientCallback>)> fn) {
+        sp<Vendor::IBiometricsFingerprintClientCallback> cb = callback();
+        if(cb == nullptr) return;
+        std::thread([=] {
+            sleepMs(delayMs);
+            fn(cb);
+        }).detach();
+    }
+
+    void burst(int n) {
+        sp<Vendor::IBiometricsFingerprintClientCallback> cb = callback();
+        for(int i = 0; i < n; i++)
+            cb->onAcquired(1, Vendor::FingerprintAcquiredInfo::ACQUIRED_GOOD, i);
+    }
+
+    Return<uint64_t> setNotify(const sp<Vendor::IBiometricsFingerprintClientCallback>& clientCallback) override {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mCallback = clientCallback;
+        }
+        later(0, [](auto cb) { cb->onSyncTemplates(1, hidl_vec<uint32_t>{1}, 0); });
+        return 1;
+    }
+    Return<uint64_t> preEnroll() override { return 1; }
+    Return<Vendor::RequestStatus> enroll(const hidl_array<uint8_t, 69>&, uint32_t, uint32_t) override {
+        return Vendor::RequestStatus::SYS_OK;
+    }
+    Return<Vendor::RequestStatus> postEnroll() override { return Vendor::RequestStatus::SYS_OK; }
+    Return<uint64_t> getAuthenticatorId() override { return 1; }
+    Return<Vendor::RequestStatus> cancel() override {
+        auto canceled = [](auto cb) { cb->onError(1, Vendor::FingerprintError::ERROR_CANCELED, 0); };
+        switch(script.cancel) {
+            case CancelMode::Ok: later(0, canceled); break;
+            case CancelMode::Missing: break;
+            case CancelMode::Late: later(script.lateCancelMs, canceled); break;
+            case CancelMode::Duplicate: later(0, [=](auto cb) { canceled(cb); canceled(cb); }); break;
+        }
+        return Vendor::RequestStatus::SYS_OK;
+    }
+    Return<Vendor::RequestStatus> enumerate() override {
+        later(0, [](auto cb) { cb->onEnumerate(1, 1, 0, 0); });
+        return Vendor::RequestStatus::SYS_OK;
+    }
+    Return<Vendor::RequestStatus> remove(uint32_t, uint32_t) override { return Vendor::RequestStatus::SYS_OK; }
+    Return<Vendor::RequestStatus> setActiveGroup(uint32_t, const hidl_string&) override {
+        return Vendor::RequestStatus::SYS_OK;
+    }
+    Return<Vendor::RequestStatus> authenticate(uint64_t, uint32_t gid) override {
+        Script s = script;
+        later(s.matchDelayMs, [this, s, gid](auto cb) {
+            for(int i = 0; i < s.acquiredBeforeMatch; i++)
+                cb->onAcquired(1, Vendor::FingerprintAcquiredInfo::ACQUIRED_GOOD, 0);
+            lastMatchNs = nowNs();
+            cb->onAuthenticated(1, 1, gid, hidl_vec<uint8_t>(69));
+        });
+        return Vendor::RequestStatus::SYS_OK;
+    }
+
+private:
+    std::mutex mLock;
+    sp<Vendor::IBiometricsFingerprintClientCallback> mCallback;
+};
+
+// Stands in for the framework's FingerprintService
+struct Client : public aosp::IBiometricsFingerprintClientCallback {
+    std::mutex lock;
+    std::condition_variable cond;
+    uint64_t authenticatedNs = 0;
+    int authenticated = 0;
+    int acquired = 0;
+    int lastVendorCode = -1;
+    int outOfOrder = 0;
+    int canceled = 0;
+
+    Return<void> onEnrollResult(uint64_t, uint32_t, uint32_t, uint32_t) override { return Void(); }
+    Return<void> onAcquired(uint64_t, aosp::FingerprintAcquiredInfo, int32_t vendorCode) override {
+        std::lock_guard<std::mutex> l(lock);
+        if(vendorCode != 0 && vendorCode != lastVendorCode + 1) outOfOrder++;
+        lastVendorCode = vendorCode;
+        acquired++;
+        cond.notify_all();
+        return Void();
+    }
+    Return<void> onAuthenticated(uint64_t, uint32_t, uint32_t, const hidl_vec<uint8_t>&) override {
+        uint64_t now = nowNs();
+        std::lock_guard<std::mutex> l(lock);
+        authenticatedNs = now;
+        authenticated++;
+        cond.notify_all();
+        return Void();
+    }
+    Return<void> onError(uint64_t, aosp::FingerprintError error, int32_t) override {
+        std::lock_guard<std::mutex> l(lock);
+        if(error == aosp::FingerprintError::ERROR_CANCELED) canceled++;
+        cond.notify_all();
+        return Void();
+    }
+    Return<void> onRemoved(uint64_t, uint32_t, uint32_t, uint32_t) override { return Void(); }
+    Return<void> onEnumerate(uint64_t, uint32_t, uint32_t, uint32_t) override { return Void(); }
+
+    template<typename Pred>
+    bool waitFor(Pred pred, int timeoutMs) {
+        std::unique_lock<std::mutex> l(lock);
+        return cond.wait_for(l, std::chrono::milliseconds(timeoutMs), pred);
+    }
+};
+
+static void printLatencies(const char *what, std::vector<uint64_t> v) {
+    if(v.empty()) {
+        printf("%s: no samples\n", what);
+        return;
+    }
+    std::sort(v.begin(), v.end());
+    auto pct = [&](int p) { return v[std::min(v.size() - 1, v.size() * p / 100)] / 1000.0; };
+    printf("%s: %zu samples, p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+            what, v.size(), pct(50), pct(90), pct(99), v.back() / 1000.0);
+}
+
+static void benchAuthenticate(const sp<aosp::IBiometricsFingerprint>& hal, StandIn *standIn, Client *client, int n) {
+    std::vector<uint64_t> latencies;
+    int lost = 0;
+    for(int i = 0; i < n; i++) {
+        int before;
+        {
+            std::lock_guard<std::mutex> l(client->lock);
+            before = client->authenticated;
+        }
+        uint64_t start = nowNs();
+        hal->authenticate(i, 0);
+        if(!client->waitFor([&] { return client->authenticated > before; }, 2000 + standIn->script.matchDelayMs)) {
+            lost++;
+            continue;
+        }
+        std::lock_guard<std::mutex> l(client->lock);
+        latencies.push_back(client->authenticatedNs - standIn->lastMatchNs);
+        if(i == 0)
+            printf("First unlock took %.3f ms end to end\n", (client->authenticatedNs - start) / 1e6);
+    }
+    printLatencies("onAuthenticated forwarding", latencies);
+    if(lost) printf("%d onAuthenticated never arrived\n", lost);
+}
+
+static void benchBurst(StandIn *standIn, Client *client, int n) {
+    {
+        std::lock_guard<std::mutex> l(client->lock);
+        client->acquired = 0;
+        client->lastVendorCode = -1;
+        client->outOfOrder = 0;
+    }
+    uint64_t start = nowNs();
+    standIn->burst(n);
+    uint64_t sent = nowNs();
+    bool all = client->waitFor([&] { return client->acquired >= n; }, 10000);
+    uint64_t done = nowNs();
+    std::lock_guard<std::mutex> l(client->lock);
+    printf("Burst of %d onAcquired: sent in %.3f ms, %s after %.3f ms, %.0f events/s, %d out of order\n",
+            n, (sent - start) / 1e6, all ? "all delivered" : "NOT all delivered",
+            (done - start) / 1e6, client->acquired / ((done - start) / 1e9), client->outOfOrder);
+}
+
+static void benchCancel(const sp<aosp::IBiometricsFingerprint>& hal, StandIn *standIn, Client *client,
+        CancelMode mode, int n) {
+    standIn->script.cancel = mode;
+    std::vector<uint64_t> durations;
+    int once = 0, none = 0, more = 0;
+    for(int i = 0; i < n; i++) {
+        {
+            std::lock_guard<std::mutex> l(client->lock);
+            client->canceled = 0;
+        }
+        uint64_t start = nowNs();
+        hal->cancel();
+        durations.push_back(nowNs() - start);
+        // Long enough for late and duplicate callbacks to trickle in
+        sleepMs(standIn->script.lateCancelMs + 100);
+        std::lock_guard<std::mutex> l(client->lock);
+        if(client->canceled == 1) once++;
+        else if(client->canceled == 0) none++;
+        else more++;
+    }
+    char what[64];
+    snprintf(what, sizeof(what), "cancel() with %s vendor cancel", cancelModeName(mode));
+    printLatencies(what, durations);
+    printf("\tframework saw ERROR_CANCELED once %d, never %d, several times %d\n", once, none, more);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: fingerprint-compat-bench [-n iterations] [-a acquired] [-d delay_ms] [-b burst] [-l late_ms]\n");
+    fprintf(stderr, "\t-n\tauthenticate and cancel rounds (default 200 and 20)\n");
+    fprintf(stderr, "\t-a\tonAcquired sent before each match (default 2)\n");
+    fprintf(stderr, "\t-d\tvendor delay before reporting a match (default 0)\n");
+    fprintf(stderr, "\t-b\tonAcquired burst size (default 1000)\n");
+    fprintf(stderr, "\t-l\thow late the late vendor cancel comes (default 300)\n");
+}
+
+int main(int argc, char **argv) {
+    int n = 200;
+    int burst = 1000;
+    sp<StandIn> standIn = new StandIn();
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        if(strcmp(argv[i], "-n") == 0) n = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-a") == 0) standIn->script.acquiredBeforeMatch = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-d") == 0) standIn->script.matchDelayMs = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-b") == 0) burst = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-l") == 0) standIn->script.lateCancelMs = atoi(argv[++i]);
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    // Calls from the adapter come in both as vendor HAL and as client
+    android::hardware::configureRpcThreadpool(4, false /*callerWillJoin*/);
+
+    uint64_t registered = nowNs();
+    if(standIn->registerAsService() != android::OK) {
+        fprintf(stderr, "Couldn't register the stand-in vendor HAL, is it in the VINTF manifest?\n");
+        return 1;
+    }
+    sp<aosp::IBiometricsFingerprint> hal = aosp::IBiometricsFingerprint::getService();
+    if(hal == nullptr) {
+        fprintf(stderr, "No fingerprint HAL showed up, is the adapter running?\n");
+        return 1;
+    }
+    sp<Client> client = new Client();
+    if(hal->setNotify(client) == 0) {
+        fprintf(stderr, "The adapter didn't attach to the stand-in\n");
+        return 1;
+    }
+    printf("Adapter attached %.3f ms after the vendor HAL registered\n", (nowNs() - registered) / 1e6);
+    hal->setActiveGroup(0, "/data/vendor_de/0/fpdata");
+
+    benchAuthenticate(hal, standIn.get(), client.get(), n);
+    benchBurst(standIn.get(), client.get(), burst);
+    int rounds = std::max(1, n / 10);
+    for(CancelMode mode: { CancelMode::Ok, CancelMode::Missing, CancelMode::Late, CancelMode::Duplicate })
+        benchCancel(hal, standIn.get(), client.get(), mode, rounds);
+    return 0;
+}
@@ -14,15 +14,22 @@
  * limitations under the License.
  */
 
-#define LOG_TAG "android.hardware.biometrics.fingerprint@2.1-service.realme_sdm710"
-
 #include <android-base/logging.h>
+#include <android-base/properties.h>
 #include <hidl/HidlTransportSupport.h>
 
 #include "BiometricsFingerprint.h"
+#include "Vendor.h"
+
+#if FP_FRONTEND_AIDL
+#include <android/binder_manager.h>
+#include <android/binder_process.h>
+#include "Fingerprint.h"
+#endif
 
 using android::hardware::biometrics::fingerprint::V2_1::IBiometricsFingerprint;
 using android::hardware::biometrics::fingerprint::V2_1::implementation::BiometricsFingerprint;
+using android::hardware::biometrics::fingerprint::V2_1::implementation::Vendor;
 using android::hardware::configureRpcThreadpool;
 using android::hardware::joinRpcThreadpool;
 using android::OK;
@@ -30,31 +37,52 @@ using android::sp;
 using android::status_t;
 
 int main() {
-    sp<BiometricsFingerprint> biometricsFingerprint;
-    status_t status;
+    sp<BiometricsFingerprint<Vendor>> biometricsFingerprint;
 
     LOG(INFO) << "Fingerprint HAL Adapter service is starting.";
 
-    biometricsFingerprint = new BiometricsFingerprint();
+    biometricsFingerprint = new BiometricsFingerprint<Vendor>();
     if (biometricsFingerprint == nullptr) {
         LOG(ERROR) << "Can not create an instance of Fingerprint HAL Adapter BiometricsFingerprint Iface, exiting.";
-        goto shutdown;
+        return 1;
     }
 
-    configureRpcThreadpool(1, true /*callerWillJoin*/);
+#if FP_FRONTEND_AIDL
+    std::shared_ptr<aidl::android::hardware::biometrics::fingerprint::Fingerprint> fingerprint =
+            ndk::SharedRefBase::make<aidl::android::hardware::biometrics::fingerprint::Fingerprint>(biometricsFingerprint);
+    // Published once the vendor HAL shows up, like the 2.1 service
+    auto publish = [fingerprint] {
+        const std::string instance = std::string(fingerprint->descriptor) + "/default";
+        binder_status_t status = AServiceManager_addService(fingerprint->asBinder().get(), instance.c_str());
+        if (status != STATUS_OK)
+            LOG(ERROR) << "Could not register " << instance << " (" << status << ")";
+        else
+            LOG(INFO) << "Fingerprint HAL Adapter AIDL service is ready.";
+    };
+#else
+    std::function<void()> publish;
+#endif
 
-    status = biometricsFingerprint->registerAsService();
-    if (status != OK) {
-        LOG(ERROR) << "Could not register service for Fingerprint HAL Adapter BiometricsFingerprint Iface ("
-                   << status << ")";
-        goto shutdown;
+    if (!biometricsFingerprint->start(publish)) {
+        // Not a device for this shim, don't let init restart us
+        LOG(INFO) << "No vendor fingerprint HAL to wrap, exiting.";
+        return 0;
     }
 
-    LOG(INFO) << "Fingerprint HAL Adapter service is ready.";
+    // Framework calls can block in the vendor TEE for a while (enroll, remove), keep
+    // threads free for vendor callbacks and notifications. At least 2, see vendorHal()
+    int threads = android::base::GetIntProperty("persist.sys.phh.fingerprint.threads", 4, 2, 16);
+    configureRpcThreadpool(threads, true /*callerWillJoin*/);
+#if FP_FRONTEND_AIDL
+    // The framework talks binder, the vendor HAL still hwbinder
+    ABinderProcess_setThreadPoolMaxThreadCount(threads);
+    ABinderProcess_startThreadPool();
+#endif
+
+    LOG(INFO) << "Fingerprint HAL Adapter service is waiting for the vendor HAL.";
     joinRpcThreadpool();
     // Should not pass this line
 
-shutdown:
     // In normal operation, we don't expect the thread pool to shutdown
     LOG(ERROR) << "Fingerprint HAL Adapter service is shutting down.";
     return 1;